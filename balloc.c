@@ -1,330 +1,1701 @@
 // SPDX-License-Identifier: GPL-2.0
 // Copyright (C) 2020, 2021 Julian Blaauboer
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/list_sort.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 #include "jbfs.h"
 
-static int jbfs_alloc_blocks_local(struct super_block *sb, uint64_t group,
-				   uint64_t local, int n, int *err)
+/*
+ * Every group keeps an in-memory index of its free runs, built from the refmap
+ * the first time the group is touched. Runs are kept in two trees: one sorted
+ * by start, to find the run containing a given block, and one sorted by
+ * length, to find a run of a given size. The index is protected by the group
+ * lock, just like the refmap itself.
+ */
+static struct jbfs_free_extent *jbfs_free_lookup(struct jbfs_group_info *gi,
+						 uint32_t local)
 {
-	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	struct buffer_head *bh;
-	uint64_t block, offset;
-	int i = 0;
+	struct rb_node *node = gi->gi_free_by_start.rb_node;
 
-	*err = 0;
+	while (node) {
+		struct jbfs_free_extent *fe =
+		    rb_entry(node, struct jbfs_free_extent, fe_start_node);
 
-	if (n <= 0 || local >= sbi->s_group_data_blocks) {
-		*err = -EINVAL;
-		return 0;
+		if (local < fe->fe_start)
+			node = node->rb_left;
+		else if (local >= fe->fe_start + fe->fe_len)
+			node = node->rb_right;
+		else
+			return fe;
 	}
 
-	block =
-	    sbi->s_offset_group + group * sbi->s_group_size +
-	    sbi->s_offset_refmap + (local >> sbi->s_log_block_size);
-	offset = local & (sb->s_blocksize - 1);
+	return NULL;
+}
 
-	bh = sb_bread(sb, block);
-	if (!bh) {
-		*err = -EIO;
-		return 0;
+static void jbfs_free_insert_len(struct jbfs_group_info *gi,
+				 struct jbfs_free_extent *fe)
+{
+	struct rb_node **p = &gi->gi_free_by_len.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct jbfs_free_extent *cur =
+		    rb_entry(*p, struct jbfs_free_extent, fe_len_node);
+
+		parent = *p;
+		if (fe->fe_len < cur->fe_len ||
+		    (fe->fe_len == cur->fe_len && fe->fe_start < cur->fe_start))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
 	}
 
-	while (i < n) {
-		if (((uint8_t *) bh->b_data)[offset])
-			goto out;
+	rb_link_node(&fe->fe_len_node, parent, p);
+	rb_insert_color(&fe->fe_len_node, &gi->gi_free_by_len);
+}
 
-		((uint8_t *) bh->b_data)[offset] = 1;
-		i += 1;
+static void jbfs_free_insert_start(struct jbfs_group_info *gi,
+				   struct jbfs_free_extent *fe)
+{
+	struct rb_node **p = &gi->gi_free_by_start.rb_node;
+	struct rb_node *parent = NULL;
 
-		if (++offset >= sb->s_blocksize) {
-			offset = 0;
-			block += 1;
-			mark_buffer_dirty(bh);
-			brelse(bh);
+	while (*p) {
+		struct jbfs_free_extent *cur =
+		    rb_entry(*p, struct jbfs_free_extent, fe_start_node);
 
-			bh = sb_bread(sb, block);
-			if (!bh) {
-				*err = -EIO;
-				return i;
-			}
-		}
+		parent = *p;
+		if (fe->fe_start < cur->fe_start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
 	}
 
- out:
-	mark_buffer_dirty(bh);
-	brelse(bh);
-	return i;
+	rb_link_node(&fe->fe_start_node, parent, p);
+	rb_insert_color(&fe->fe_start_node, &gi->gi_free_by_start);
 }
 
-static int jbfs_alloc_blocks(struct super_block *sb, uint64_t start, int n,
-			     int *err, int lock_group)
+static void jbfs_free_resize(struct jbfs_group_info *gi,
+			     struct jbfs_free_extent *fe, uint32_t start,
+			     uint32_t len)
 {
-	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	uint64_t group, local;
-	int ret;
+	rb_erase(&fe->fe_len_node, &gi->gi_free_by_len);
+	fe->fe_start = start;
+	fe->fe_len = len;
+	jbfs_free_insert_len(gi, fe);
+}
 
-	group = (start - sbi->s_offset_group) / sbi->s_group_size;
-	local =
-	    (start - sbi->s_offset_group) % sbi->s_group_size -
-	    sbi->s_offset_data;
+static void jbfs_free_erase(struct jbfs_group_info *gi,
+			    struct jbfs_free_extent *fe)
+{
+	rb_erase(&fe->fe_start_node, &gi->gi_free_by_start);
+	rb_erase(&fe->fe_len_node, &gi->gi_free_by_len);
+	kfree(fe);
+}
 
-	if (lock_group)
-		JBFS_GROUP_LOCK(sbi, group);
+static void jbfs_drop_group_index(struct jbfs_group_info *gi)
+{
+	struct jbfs_free_extent *fe, *tmp;
 
-	if (start >= sbi->s_num_blocks) {
-		*err = -ENOSPC;
-		ret = 0;
-		goto out;
+	rbtree_postorder_for_each_entry_safe(fe, tmp, &gi->gi_free_by_start,
+					     fe_start_node)
+		kfree(fe);
+
+	gi->gi_free_by_start = RB_ROOT;
+	gi->gi_free_by_len = RB_ROOT;
+	gi->gi_loaded = 0;
+	gi->gi_generation += 1;
+}
+
+/*
+ * Add a free run to the index, merging it with its neighbours. If memory runs
+ * out, the index is dropped and will be rebuilt from the summary later.
+ */
+static void jbfs_free_add(struct jbfs_group_info *gi, uint32_t start,
+			  uint32_t len)
+{
+	struct rb_node *node = gi->gi_free_by_start.rb_node;
+	struct jbfs_free_extent *prev = NULL, *next = NULL, *fe;
+
+	while (node) {
+		fe = rb_entry(node, struct jbfs_free_extent, fe_start_node);
+		if (start < fe->fe_start) {
+			next = fe;
+			node = node->rb_left;
+		} else {
+			prev = fe;
+			node = node->rb_right;
+		}
 	}
 
-	ret = jbfs_alloc_blocks_local(sb, group, local, n, err);
+	if (prev && prev->fe_start + prev->fe_len != start)
+		prev = NULL;
+	if (next && start + len != next->fe_start)
+		next = NULL;
 
-out:
-	JBFS_GROUP_UNLOCK(sbi, group);
-	return ret;
+	if (prev && next) {
+		len += next->fe_len;
+		jbfs_free_erase(gi, next);
+	}
+
+	if (prev) {
+		jbfs_free_resize(gi, prev, prev->fe_start, prev->fe_len + len);
+		return;
+	}
+
+	if (next) {
+		/* The start changes, but the order in the start tree doesn't. */
+		jbfs_free_resize(gi, next, start, next->fe_len + len);
+		return;
+	}
+
+	fe = kmalloc(sizeof(*fe), GFP_NOFS);
+	if (!fe) {
+		jbfs_drop_group_index(gi);
+		return;
+	}
+
+	fe->fe_start = start;
+	fe->fe_len = len;
+	jbfs_free_insert_start(gi, fe);
+	jbfs_free_insert_len(gi, fe);
 }
 
-static int jbfs_dealloc_blocks_local(struct super_block *sb, uint64_t group,
-				     uint64_t local, int n, int *err)
+/*
+ * Remove [start, start + len) from the free run fe, which must contain it.
+ */
+static void jbfs_free_take(struct jbfs_group_info *gi,
+			   struct jbfs_free_extent *fe, uint32_t start,
+			   uint32_t len)
 {
-	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	struct buffer_head *bh;
-	uint64_t block, offset;
-	int i = 0;
+	uint32_t end = fe->fe_start + fe->fe_len;
+	struct jbfs_free_extent *tail;
 
-	*err = 0;
+	if (start == fe->fe_start && len == fe->fe_len) {
+		jbfs_free_erase(gi, fe);
+		return;
+	}
 
-	if (n <= 0 || local >= sbi->s_group_data_blocks) {
-		*err = -EINVAL;
-		return 0;
+	if (start == fe->fe_start) {
+		jbfs_free_resize(gi, fe, start + len, fe->fe_len - len);
+		return;
 	}
 
-	block =
-	    sbi->s_offset_group + group * sbi->s_group_size +
-	    sbi->s_offset_refmap + (local >> sbi->s_log_block_size);
-	offset = local & (sb->s_blocksize - 1);
+	if (start + len == end) {
+		jbfs_free_resize(gi, fe, fe->fe_start, fe->fe_len - len);
+		return;
+	}
 
-	bh = sb_bread(sb, block);
-	if (!bh) {
-		*err = -EIO;
-		return 0;
+	tail = kmalloc(sizeof(*tail), GFP_NOFS);
+	if (!tail) {
+		jbfs_drop_group_index(gi);
+		return;
 	}
 
-	while (i < n) {
-		if (((uint8_t *) bh->b_data)[offset])
-			((uint8_t *) bh->b_data)[offset] -= 1;
+	jbfs_free_resize(gi, fe, fe->fe_start, start - fe->fe_start);
+	tail->fe_start = start + len;
+	tail->fe_len = end - tail->fe_start;
+	jbfs_free_insert_start(gi, tail);
+	jbfs_free_insert_len(gi, tail);
+}
 
-		i += 1;
+/*
+ * Find the smallest free run of at least n blocks, or the largest run if
+ * none is long enough.
+ */
+static struct jbfs_free_extent *jbfs_free_find(struct jbfs_group_info *gi,
+					       uint32_t n)
+{
+	struct rb_node *node = gi->gi_free_by_len.rb_node;
+	struct jbfs_free_extent *best = NULL;
 
-		if (++offset >= sb->s_blocksize) {
-			offset = 0;
-			block += 1;
-			mark_buffer_dirty(bh);
-			brelse(bh);
+	while (node) {
+		struct jbfs_free_extent *fe =
+		    rb_entry(node, struct jbfs_free_extent, fe_len_node);
 
-			bh = sb_bread(sb, block);
-			if (!bh) {
-				*err = -EIO;
-				return i;
-			}
+		if (fe->fe_len >= n) {
+			best = fe;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
 		}
 	}
 
-	mark_buffer_dirty(bh);
-	brelse(bh);
-	return i;
+	if (best)
+		return best;
+
+	node = rb_last(&gi->gi_free_by_len);
+	if (!node)
+		return NULL;
+
+	return rb_entry(node, struct jbfs_free_extent, fe_len_node);
 }
 
-static int jbfs_dealloc_blocks(struct super_block *sb, uint64_t start, int n,
-			       int *err)
+/*
+ * On top of the refmap, every loaded group keeps a two-level summary in
+ * memory: gi_used has one bit per block that is set if the block is in use,
+ * and gi_full one bit per word of gi_used that is set if all blocks in it are
+ * in use. Searching for free blocks only needs a bit per block instead of a
+ * byte, and gi_full lets it skip over used regions a whole word of words
+ * (4096 blocks on 64-bit) at a time. Bits in gi_used past the end of the
+ * group are set, so the last word can be full as well.
+ *
+ * The summary is built from the refmap the first time a group is loaded and
+ * kept up to date from then on, so the free run index can be rebuilt from it
+ * without going back to disk.
+ */
+static void jbfs_summary_set(struct jbfs_group_info *gi, uint32_t start,
+			     uint32_t len)
 {
-	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	uint64_t group, local;
-	int ret;
+	unsigned long w;
 
-	group = (start - sbi->s_offset_group) / sbi->s_group_size;
-	local =
-	    (start - sbi->s_offset_group) % sbi->s_group_size -
-	    sbi->s_offset_data;
+	if (!gi->gi_used || !len)
+		return;
 
-	JBFS_GROUP_LOCK(sbi, group);
+	bitmap_set(gi->gi_used, start, len);
 
-	ret = jbfs_dealloc_blocks_local(sb, group, local, n, err);
+	for (w = start / BITS_PER_LONG; w <= (start + len - 1) / BITS_PER_LONG;
+	     ++w) {
+		if (gi->gi_used[w] == ~0UL)
+			set_bit(w, gi->gi_full);
+	}
+}
 
-	JBFS_GROUP_UNLOCK(sbi, group);
-	return ret;
+static void jbfs_summary_clear(struct jbfs_group_info *gi, uint32_t start,
+			       uint32_t len)
+{
+	unsigned long w;
+
+	if (!gi->gi_used || !len)
+		return;
+
+	bitmap_clear(gi->gi_used, start, len);
+
+	for (w = start / BITS_PER_LONG; w <= (start + len - 1) / BITS_PER_LONG;
+	     ++w)
+		clear_bit(w, gi->gi_full);
 }
 
-static uint64_t jbfs_find_free_in_group(struct super_block *sb, uint64_t group,
-					int n, int *err)
+/*
+ * Returns the first free block at or after from, or n if there is none.
+ */
+static uint32_t jbfs_summary_next_free(struct jbfs_group_info *gi,
+				       uint32_t from, uint32_t n)
+{
+	unsigned long words = BITS_TO_LONGS(n);
+
+	while (from < n) {
+		unsigned long w = from / BITS_PER_LONG;
+		unsigned long bits =
+		    ~gi->gi_used[w] & BITMAP_FIRST_WORD_MASK(from);
+
+		if (bits)
+			return min_t(uint32_t, w * BITS_PER_LONG + __ffs(bits),
+				     n);
+
+		w = find_next_zero_bit(gi->gi_full, words, w + 1);
+		if (w >= words)
+			break;
+		from = w * BITS_PER_LONG;
+	}
+
+	return n;
+}
+
+static void jbfs_free_summary(struct jbfs_group_info *gi)
+{
+	bitmap_free(gi->gi_used);
+	bitmap_free(gi->gi_full);
+	gi->gi_used = NULL;
+	gi->gi_full = NULL;
+}
+
+/*
+ * Build the summary of a group from its refmap, and fix up the free block
+ * count of the group if it turns out to be wrong. Must be called with the
+ * group locked.
+ */
+static int jbfs_load_summary(struct super_block *sb, uint64_t group)
 {
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_group_info *gi = &sbi->s_group_info[group];
+	uint32_t n = sbi->s_group_data_blocks;
 	struct buffer_head *bh;
-	int count = 0;
+	uint32_t free = 0;
 	uint64_t block;
 	int offset = 0;
-	int i;
+	unsigned long w;
+	uint32_t i;
 
-	*err = 0;
+	gi->gi_used = bitmap_zalloc(round_up(n, BITS_PER_LONG), GFP_NOFS);
+	gi->gi_full = bitmap_zalloc(BITS_TO_LONGS(n), GFP_NOFS);
+	if (!gi->gi_used || !gi->gi_full) {
+		jbfs_free_summary(gi);
+		return -ENOMEM;
+	}
 
 	block =
 	    sbi->s_offset_group + group * sbi->s_group_size +
 	    sbi->s_offset_refmap;
 	bh = sb_bread(sb, block);
-	if (!bh)
-		goto out_no_bh;
+	if (!bh) {
+		jbfs_free_summary(gi);
+		return -EIO;
+	}
 
-	for (i = 0; i < sbi->s_group_data_blocks; ++i) {
-		uint8_t ref = ((uint8_t *) bh->b_data)[offset];
+	i = 0;
+	while (i < n) {
+		uint8_t *map = (uint8_t *) bh->b_data + offset;
+		uint32_t len = min_t(uint32_t, sb->s_blocksize - offset, n - i);
+		uint32_t run = jbfs_refmap_free(map, len);
+		uint32_t used;
 
-		if (!ref) {
-			if (++count == n)
-				break;
-		} else {
-			count = 0;
-		}
+		free += run;
+		used = jbfs_refmap_used(map + run, len - run);
+		bitmap_set(gi->gi_used, i + run, used);
 
-		if (++offset == sb->s_blocksize) {
+		i += run + used;
+		offset += run + used;
+
+		if (offset == sb->s_blocksize && i < n) {
 			offset = 0;
 			brelse(bh);
 			bh = sb_bread(sb, ++block);
-			if (!bh)
-				goto out_no_bh;
+			if (!bh) {
+				jbfs_free_summary(gi);
+				return -EIO;
+			}
 		}
 	}
 
 	brelse(bh);
 
-	if (count == n)
-		return sbi->s_offset_group + group * sbi->s_group_size +
-		    sbi->s_offset_data + i;
+	bitmap_set(gi->gi_used, n, round_up(n, BITS_PER_LONG) - n);
+	for (w = 0; w < BITS_TO_LONGS(n); ++w) {
+		if (gi->gi_used[w] == ~0UL)
+			set_bit(w, gi->gi_full);
+	}
 
-	*err = -ENOSPC;
-	return 0;
+	if (free != gi->gi_free_blocks) {
+		printk(KERN_WARNING
+		       "jbfs: group %llu has %u free blocks, descriptor says %u\n",
+		       group, free, gi->gi_free_blocks);
+		percpu_counter_add(&sbi->s_free_blocks,
+				   (int64_t)free - gi->gi_free_blocks);
+		gi->gi_free_blocks = free;
+		jbfs_write_group_desc(sb, group);
+	}
 
- out_no_bh:
-	*err = -EIO;
 	return 0;
 }
 
-static uint64_t jbfs_find_free(struct inode *inode, int n, int *err)
+/*
+ * Build the free run index of a group from its summary, if that hasn't been
+ * done yet. Must be called with the group locked.
+ */
+static int jbfs_load_group(struct super_block *sb, uint64_t group)
 {
-	struct super_block *sb = inode->i_sb;
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	uint64_t start, group, block;
+	struct jbfs_group_info *gi = &sbi->s_group_info[group];
+	uint32_t n = sbi->s_group_data_blocks;
+	uint32_t start = 0;
+	int err;
 
-	start = inode->i_ino >> sbi->s_local_inode_bits;
-	group = start;
+	if (gi->gi_loaded)
+		return 0;
 
-	do {
-		// TODO: Check group descriptor
-		JBFS_GROUP_LOCK(sbi, group);
+	if (!gi->gi_used) {
+		err = jbfs_load_summary(sb, group);
+		if (err)
+			return err;
+	}
 
-		block = jbfs_find_free_in_group(sb, group, n, err);
-		if (block)
-			break;
+	/*
+	 * Set this early, since jbfs_free_add clears it again if it runs out
+	 * of memory.
+	 */
+	gi->gi_loaded = 1;
 
-		JBFS_GROUP_UNLOCK(sbi, group);
+	while (gi->gi_loaded) {
+		uint32_t end;
 
-		if (*err == -EIO)
+		start = jbfs_summary_next_free(gi, start, n);
+		if (start >= n)
 			break;
 
-		if (++group >= sbi->s_num_groups)
-			group = 0;
-	} while (group != start);
+		end = find_next_bit(gi->gi_used, n, start);
+		jbfs_free_add(gi, start, end - start);
+		start = end;
+	}
 
-	return block;
+	if (!gi->gi_loaded) {
+		jbfs_drop_group_index(gi);
+		return -ENOMEM;
+	}
+
+	return 0;
 }
 
-uint64_t jbfs_new_block(struct inode *inode, int *err)
+static struct buffer_head *jbfs_read_group_desc(struct super_block *sb,
+						uint64_t group,
+						struct jbfs_group_descriptor
+						**gd)
 {
-	struct jbfs_inode_info *jbfs_inode = JBFS_I(inode);
-	uint64_t start;
-	int n = 0;
-	int i;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct buffer_head *bh;
 
-	// TODO: Support i_cont
-	for (i = 0; i < 12; ++i) {
-		if (!jbfs_inode->i_extents[i][0])
-			break;
+	bh = sb_bread(sb, sbi->s_offset_group + group * sbi->s_group_size);
+	if (!bh) {
+		printk(KERN_ERR "jbfs: unable to read descriptor of group %llu\n",
+		       group);
+		return NULL;
 	}
 
-	/*
-	 * First, try extending previous extent.
-	 */
-	if (i > 0) {
-		n = jbfs_alloc_blocks(inode->i_sb,
-				      jbfs_inode->i_extents[i - 1][1] + 1, 1,
-				      err, 1);
-		jbfs_inode->i_extents[i - 1][1] += n;
-
-		if (n) {
-			*err = 0;
-			i -= 1;
-			goto out;
+	*gd = (struct jbfs_group_descriptor *)bh->b_data;
+	return bh;
+}
+
+/*
+ * Write the cached free counts of a group back to its descriptor. Must be
+ * called with the group locked.
+ */
+void jbfs_write_group_desc(struct super_block *sb, uint64_t group)
+{
+	struct jbfs_group_info *gi = &JBFS_SB(sb)->s_group_info[group];
+	struct jbfs_group_descriptor *gd;
+	struct buffer_head *bh;
+
+	bh = jbfs_read_group_desc(sb, group, &gd);
+	if (!bh)
+		return;
+
+	gd->g_free_inodes = cpu_to_le32(gi->gi_free_inodes);
+	gd->g_free_blocks = cpu_to_le32(gi->gi_free_blocks);
+	gd->g_used_dirs = cpu_to_le32(gi->gi_used_dirs);
+	gd->g_flags = cpu_to_le32(gi->gi_flags & ~JBFS_GROUP_INODE_ZEROING);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+}
+
+/*
+ * Freed blocks only need to go into the index if it has been built already;
+ * otherwise they will be picked up from the summary or refmap when it is.
+ */
+static void jbfs_free_add_loaded(struct jbfs_group_info *gi, uint32_t start,
+				 uint32_t len)
+{
+	jbfs_summary_clear(gi, start, len);
+	if (gi->gi_loaded)
+		jbfs_free_add(gi, start, len);
+}
+
+/*
+ * With the discard mount option, freed runs are discarded in the background.
+ * Until the discard has been issued, a run stays out of the free run index
+ * and marked as used in the summary, so it can't be handed out again and
+ * then have its new contents discarded. Runs freed in quick succession are
+ * sorted and merged, and sent to the device in one batch.
+ */
+struct jbfs_discard {
+	struct list_head d_list;
+	uint64_t d_group;
+	uint32_t d_start;
+	uint32_t d_len;
+};
+
+#define JBFS_DISCARD_DELAY (HZ / 10)
+
+static int jbfs_discard_cmp(void *priv, struct list_head *a,
+			    struct list_head *b)
+{
+	struct jbfs_discard *da = list_entry(a, struct jbfs_discard, d_list);
+	struct jbfs_discard *db = list_entry(b, struct jbfs_discard, d_list);
+
+	if (da->d_group != db->d_group)
+		return da->d_group < db->d_group ? -1 : 1;
+	if (da->d_start != db->d_start)
+		return da->d_start < db->d_start ? -1 : 1;
+	return 0;
+}
+
+static void jbfs_discard_worker(struct work_struct *work)
+{
+	struct jbfs_sb_info *sbi = container_of(to_delayed_work(work),
+						struct jbfs_sb_info,
+						s_discard_work);
+	struct super_block *sb = sbi->s_sb;
+	struct jbfs_discard *d, *next;
+	LIST_HEAD(batch);
+
+	spin_lock(&sbi->s_discard_lock);
+	list_splice_init(&sbi->s_discard_list, &batch);
+	spin_unlock(&sbi->s_discard_lock);
+
+	list_sort(NULL, &batch, jbfs_discard_cmp);
+
+	list_for_each_entry_safe(d, next, &batch, d_list) {
+		uint64_t block;
+
+		/*
+		 * Merge with the following runs while they are adjacent.
+		 */
+		while (&next->d_list != &batch && next->d_group == d->d_group &&
+		       next->d_start == d->d_start + d->d_len) {
+			struct jbfs_discard *tmp = next;
+
+			d->d_len += tmp->d_len;
+			next = list_next_entry(tmp, d_list);
+			list_del(&tmp->d_list);
+			kfree(tmp);
 		}
-	}
 
-	if (i > 11) {
-		*err = -EFBIG;
-		return 0;
+		block = sbi->s_offset_group + d->d_group * sbi->s_group_size +
+		    sbi->s_offset_data + d->d_start;
+		sb_issue_discard(sb, block, d->d_len, GFP_NOFS, 0);
+
+		JBFS_GROUP_LOCK(sbi, d->d_group);
+		jbfs_free_add_loaded(&sbi->s_group_info[d->d_group],
+				     d->d_start, d->d_len);
+		JBFS_GROUP_UNLOCK(sbi, d->d_group);
+
+		list_del(&d->d_list);
+		kfree(d);
 	}
+}
 
-	/*
-	 * Otherwise, start a new extent.
-	 */
-	start = jbfs_find_free(inode, 1, err);
-	if (!start)
-		return 0;
+/*
+ * Return a run whose refcounts dropped to zero to the free space of its
+ * group, or queue it to be discarded first. Must be called with the group
+ * locked.
+ */
+static void jbfs_free_run(struct super_block *sb, uint64_t group,
+			  uint32_t start, uint32_t len, int discard)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_discard *d;
 
-	n = jbfs_alloc_blocks(inode->i_sb, start, 1, err, 0);
-	if (!n)
-		return 0;
+	if (discard) {
+		d = kmalloc(sizeof(*d), GFP_NOFS);
+		if (d) {
+			d->d_group = group;
+			d->d_start = start;
+			d->d_len = len;
 
-	jbfs_inode->i_extents[i][0] = start;
-	jbfs_inode->i_extents[i][1] = start;
+			spin_lock(&sbi->s_discard_lock);
+			list_add_tail(&d->d_list, &sbi->s_discard_list);
+			spin_unlock(&sbi->s_discard_lock);
 
-	*err = 0;
- out:
-	// TODO: Update group descriptor
-	mark_inode_dirty(inode);
-	return jbfs_inode->i_extents[i][1];
+			schedule_delayed_work(&sbi->s_discard_work,
+					      JBFS_DISCARD_DELAY);
+			return;
+		}
+	}
+
+	jbfs_free_add_loaded(&sbi->s_group_info[group], start, len);
 }
 
-// TODO: Update group descriptor
-// TODO: Use i_cont
-// TODO: Error handling?
-void jbfs_truncate(struct inode *inode)
+int jbfs_init_group_info(struct super_block *sb)
 {
-	struct super_block *sb = inode->i_sb;
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	struct jbfs_inode_info *ji = JBFS_I(inode);
-	uint64_t blocks =
-	    (inode->i_size + sb->s_blocksize - 1) >> sbi->s_log_block_size;
+	uint64_t free_blocks = 0, free_inodes = 0, dirs = 0;
 	uint64_t i;
-	int err;
+	int cpu;
 
-	block_truncate_page(inode->i_mapping, inode->i_size, jbfs_get_block);
-
-	for (i = 0; i < 12; ++i) {
-		uint64_t start = ji->i_extents[i][0];
-		uint64_t end = ji->i_extents[i][1];
-		uint64_t len = end - start + !!start;
-		if (blocks && blocks >= len) {
-			blocks -= len;
-		} else if (blocks > 0) {
-			blocks -= 1;
-			jbfs_dealloc_blocks(inode->i_sb, start + blocks,
-					    len - blocks, &err);
-			ji->i_extents[i][1] = start + blocks;
-			blocks = 0;
-		} else {
-			jbfs_dealloc_blocks(inode->i_sb, start, len, &err);
-			ji->i_extents[i][0] = ji->i_extents[i][1] = 0;
-		}
+	spin_lock_init(&sbi->s_discard_lock);
+	INIT_LIST_HEAD(&sbi->s_discard_list);
+	INIT_DELAYED_WORK(&sbi->s_discard_work, jbfs_discard_worker);
+	init_waitqueue_head(&sbi->s_inode_init_wait);
+
+	sbi->s_group_info =
+	    kvcalloc(sbi->s_num_groups, sizeof(struct jbfs_group_info),
+		     GFP_KERNEL);
+	if (!sbi->s_group_info)
+		return -ENOMEM;
+
+	sbi->s_alloc_rotor = alloc_percpu(uint64_t);
+	if (!sbi->s_alloc_rotor) {
+		jbfs_destroy_group_info(sb);
+		return -ENOMEM;
 	}
 
-	inode->i_mtime = inode->i_ctime = current_time(inode);
+	/*
+	 * Start every CPU in a different part of the filesystem.
+	 */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(sbi->s_alloc_rotor, cpu) =
+		    cpu * sbi->s_num_groups / nr_cpu_ids;
+
+	for (i = 0; i < sbi->s_num_groups; ++i) {
+		struct jbfs_group_info *gi = &sbi->s_group_info[i];
+		struct jbfs_group_descriptor *gd;
+		struct buffer_head *bh;
+
+		mutex_init(&gi->gi_lock);
+		gi->gi_free_by_start = RB_ROOT;
+		gi->gi_free_by_len = RB_ROOT;
+
+		bh = jbfs_read_group_desc(sb, i, &gd);
+		if (!bh) {
+			jbfs_destroy_group_info(sb);
+			return -EIO;
+		}
+
+		gi->gi_free_blocks = min(le32_to_cpu(gd->g_free_blocks),
+					 sbi->s_group_data_blocks);
+		gi->gi_free_inodes = min(le32_to_cpu(gd->g_free_inodes),
+					 sbi->s_group_inodes);
+		gi->gi_used_dirs = min(le32_to_cpu(gd->g_used_dirs),
+				       sbi->s_group_inodes - gi->gi_free_inodes);
+		gi->gi_flags = le32_to_cpu(gd->g_flags) &
+		    ~JBFS_GROUP_INODE_ZEROING;
+		free_blocks += gi->gi_free_blocks;
+		free_inodes += gi->gi_free_inodes;
+		dirs += gi->gi_used_dirs;
+		brelse(bh);
+	}
+
+	/*
+	 * The totals are seeded from the group descriptors, which are kept
+	 * up to date, rather than trusted from the super block.
+	 */
+	if (percpu_counter_init(&sbi->s_free_blocks, free_blocks, GFP_KERNEL) ||
+	    percpu_counter_init(&sbi->s_free_inodes, free_inodes, GFP_KERNEL) ||
+	    percpu_counter_init(&sbi->s_dirs, dirs, GFP_KERNEL)) {
+		jbfs_destroy_group_info(sb);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void jbfs_destroy_group_info(struct super_block *sb)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t i;
+
+	if (!sbi->s_group_info)
+		return;
+
+	flush_delayed_work(&sbi->s_discard_work);
+
+	for (i = 0; i < sbi->s_num_groups; ++i) {
+		jbfs_drop_group_index(&sbi->s_group_info[i]);
+		jbfs_free_summary(&sbi->s_group_info[i]);
+	}
+
+	percpu_counter_destroy(&sbi->s_free_blocks);
+	percpu_counter_destroy(&sbi->s_free_inodes);
+	percpu_counter_destroy(&sbi->s_dirs);
+	free_percpu(sbi->s_alloc_rotor);
+	sbi->s_alloc_rotor = NULL;
+	kvfree(sbi->s_group_info);
+	sbi->s_group_info = NULL;
+}
+
+/*
+ * Mark up to n blocks as used in the refmap, stopping at the first block that
+ * is already in use. Returns the number of blocks marked.
+ */
+static int jbfs_set_refmap(struct super_block *sb, uint64_t group,
+			   uint64_t local, int n, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t block, offset;
+	int i = 0;
+
+	block =
+	    sbi->s_offset_group + group * sbi->s_group_size +
+	    sbi->s_offset_refmap + (local >> sbi->s_log_block_size);
+	offset = local & (sb->s_blocksize - 1);
+
+	bh = sb_bread(sb, block);
+	if (!bh) {
+		*err = -EIO;
+		return 0;
+	}
+
+	while (i < n) {
+		uint8_t *map = (uint8_t *) bh->b_data + offset;
+		uint32_t len = min_t(uint64_t, n - i, sb->s_blocksize - offset);
+		uint32_t run = jbfs_refmap_free(map, len);
+
+		memset(map, 1, run);
+		jbfs_summary_set(&sbi->s_group_info[group], local + i, run);
+		i += run;
+
+		if (run < len)
+			break;
+
+		if (i < n) {
+			offset = 0;
+			block += 1;
+			mark_buffer_dirty(bh);
+			brelse(bh);
+
+			bh = sb_bread(sb, block);
+			if (!bh) {
+				*err = -EIO;
+				return i;
+			}
+		}
+	}
+
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return i;
+}
+
+/*
+ * Must be called with the group locked.
+ */
+static void jbfs_count_alloc(struct super_block *sb, uint64_t group, int n)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+
+	sbi->s_group_info[group].gi_free_blocks -= n;
+	percpu_counter_sub(&sbi->s_free_blocks, n);
+	jbfs_write_group_desc(sb, group);
+}
+
+static int jbfs_alloc_blocks_local(struct super_block *sb, uint64_t group,
+				   uint64_t local, int n, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_group_info *gi = &sbi->s_group_info[group];
+	struct jbfs_free_extent *fe;
+	int i;
+
+	*err = 0;
+
+	if (n <= 0 || local >= sbi->s_group_data_blocks) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	*err = jbfs_load_group(sb, group);
+	if (*err)
+		return 0;
+
+	fe = jbfs_free_lookup(gi, local);
+	if (!fe)
+		return 0;
+
+	if (n > fe->fe_start + fe->fe_len - local)
+		n = fe->fe_start + fe->fe_len - local;
+
+	i = jbfs_set_refmap(sb, group, local, n, err);
+	if (i) {
+		jbfs_free_take(gi, fe, local, i);
+		jbfs_count_alloc(sb, group, i);
+	}
+	return i;
+}
+
+static int jbfs_alloc_blocks(struct super_block *sb, uint64_t start, int n,
+			     int *err, int lock_group)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t group, local;
+	int ret;
+
+	group = (start - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (start - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+
+	if (start >= sbi->s_num_blocks || group >= sbi->s_num_groups) {
+		if (!lock_group && group < sbi->s_num_groups)
+			JBFS_GROUP_UNLOCK(sbi, group);
+		*err = -ENOSPC;
+		return 0;
+	}
+
+	if (lock_group)
+		JBFS_GROUP_LOCK(sbi, group);
+
+	ret = jbfs_alloc_blocks_local(sb, group, local, n, err);
+
+	JBFS_GROUP_UNLOCK(sbi, group);
+	return ret;
+}
+
+static int jbfs_dealloc_blocks_local(struct super_block *sb, uint64_t group,
+				     uint64_t local, int n, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t block, offset;
+	int discard = 0;
+	int freed = 0;
+	int total = 0;
+	int i = 0;
+
+	*err = 0;
+
+	if (n <= 0 || local >= sbi->s_group_data_blocks) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	/*
+	 * Blocks waiting to be discarded are kept marked as used in the
+	 * summary, so it has to exist before the refmap is changed.
+	 */
+	if (jbfs_test_opt(sb, DISCARD))
+		discard = !jbfs_load_group(sb, group);
+
+	block =
+	    sbi->s_offset_group + group * sbi->s_group_size +
+	    sbi->s_offset_refmap + (local >> sbi->s_log_block_size);
+	offset = local & (sb->s_blocksize - 1);
+
+	bh = sb_bread(sb, block);
+	if (!bh) {
+		*err = -EIO;
+		return 0;
+	}
+
+	while (i < n) {
+		uint8_t *ref = (uint8_t *) bh->b_data + offset;
+
+		if (*ref && !--*ref) {
+			freed += 1;
+			total += 1;
+		} else if (freed) {
+			jbfs_free_run(sb, group, local + i - freed, freed,
+				      discard);
+			freed = 0;
+		}
+
+		i += 1;
+
+		if (++offset >= sb->s_blocksize) {
+			offset = 0;
+			block += 1;
+			mark_buffer_dirty(bh);
+			brelse(bh);
+
+			bh = sb_bread(sb, block);
+			if (!bh) {
+				*err = -EIO;
+				goto out_no_bh;
+			}
+		}
+	}
+
+	mark_buffer_dirty(bh);
+	brelse(bh);
+ out_no_bh:
+	if (freed)
+		jbfs_free_run(sb, group, local + i - freed, freed, discard);
+	if (total) {
+		sbi->s_group_info[group].gi_free_blocks += total;
+		percpu_counter_add(&sbi->s_free_blocks, total);
+		jbfs_write_group_desc(sb, group);
+	}
+	return i;
+}
+
+int jbfs_dealloc_blocks(struct super_block *sb, uint64_t start, int n, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t group, local;
+	int ret;
+
+	group = (start - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (start - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+
+	if (n <= 0 || group >= sbi->s_num_groups) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	JBFS_GROUP_LOCK(sbi, group);
+
+	ret = jbfs_dealloc_blocks_local(sb, group, local, n, err);
+
+	JBFS_GROUP_UNLOCK(sbi, group);
+	return ret;
+}
+
+/*
+ * Return the number of references to a block, as stored in the refmap.
+ */
+int jbfs_block_refs(struct super_block *sb, uint64_t block, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t group, local;
+	int refs;
+
+	*err = 0;
+
+	group = (block - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (block - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+
+	if (group >= sbi->s_num_groups || local >= sbi->s_group_data_blocks) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	bh = sb_bread(sb, sbi->s_offset_group + group * sbi->s_group_size +
+		      sbi->s_offset_refmap + (local >> sbi->s_log_block_size));
+	if (!bh) {
+		*err = -EIO;
+		return 0;
+	}
+
+	refs = ((uint8_t *) bh->b_data)[local & (sb->s_blocksize - 1)];
+	brelse(bh);
+	return refs;
+}
+
+/*
+ * Take another reference to each of up to n blocks at start, which must all
+ * be in use and lie in a single group. Referencing stops at the first block
+ * that already has JBFS_MAX_REFS references. Returns the number of blocks
+ * referenced.
+ */
+int jbfs_ref_blocks(struct super_block *sb, uint64_t start, int n, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct buffer_head *bh;
+	uint64_t group, local, block, offset;
+	int pass, i, j, len;
+
+	*err = 0;
+
+	group = (start - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (start - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+
+	if (n <= 0 || group >= sbi->s_num_groups ||
+	    local >= sbi->s_group_data_blocks ||
+	    n > sbi->s_group_data_blocks - local) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	JBFS_GROUP_LOCK(sbi, group);
+
+	/*
+	 * The first pass finds how many blocks can be referenced, so a free
+	 * block is caught before anything is changed. The second one takes
+	 * the references.
+	 */
+	for (pass = 0; pass < 2 && !*err; ++pass) {
+		block =
+		    sbi->s_offset_group + group * sbi->s_group_size +
+		    sbi->s_offset_refmap + (local >> sbi->s_log_block_size);
+		offset = local & (sb->s_blocksize - 1);
+
+		for (i = 0; i < n; i += len) {
+			uint8_t *map;
+
+			len = min_t(uint64_t, n - i, sb->s_blocksize - offset);
+
+			bh = sb_bread(sb, block);
+			if (!bh) {
+				*err = -EIO;
+				break;
+			}
+
+			map = (uint8_t *) bh->b_data + offset;
+			for (j = 0; j < len; ++j) {
+				if (pass) {
+					map[j] += 1;
+					continue;
+				}
+				if (!map[j]) {
+					printk(KERN_ERR
+					       "jbfs: reference to free block %llu\n",
+					       start + i + j);
+					*err = -EIO;
+				}
+				if (!map[j] || map[j] >= JBFS_MAX_REFS) {
+					n = i + j;
+					break;
+				}
+			}
+
+			if (pass)
+				mark_buffer_dirty(bh);
+			brelse(bh);
+
+			offset = 0;
+			block += 1;
+		}
+	}
+
+	JBFS_GROUP_UNLOCK(sbi, group);
+	return *err ? 0 : n;
+}
+
+/*
+ * Find a run of *n free blocks in a group. If no run is long enough, the
+ * longest run found is returned instead and *n is updated to its length.
+ */
+static uint64_t jbfs_find_free_in_group(struct super_block *sb, uint64_t group,
+					int *n, int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_free_extent *fe;
+
+	*err = jbfs_load_group(sb, group);
+	if (*err)
+		return 0;
+
+	fe = jbfs_free_find(&sbi->s_group_info[group], *n);
+	if (!fe) {
+		*err = -ENOSPC;
+		return 0;
+	}
+
+	if (*n > fe->fe_len)
+		*n = fe->fe_len;
+
+	return sbi->s_offset_group + group * sbi->s_group_size +
+	    sbi->s_offset_data + fe->fe_start;
+}
+
+/*
+ * Pick the group to start looking for free blocks in. Files keep growing in
+ * the group of their last extent. New directories and small files stay in the
+ * group of their inode, which is next to their parent directory. Everything
+ * else starts at a per-CPU rotor, so concurrent writers of large files are
+ * spread over the filesystem instead of all contending for the same group.
+ * Must be called with the extent lock of the inode held.
+ */
+static uint64_t jbfs_goal_group(struct inode *inode, int n, int *stream)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(inode->i_sb);
+	struct jbfs_extent ext;
+	uint64_t end, group;
+
+	*stream = 0;
+
+	if (jbfs_extent_end(inode, &end))
+		end = 0;
+	if (end && !jbfs_extent_lookup(inode, end - 1, &ext) &&
+	    !(ext.e_flags & JBFS_EXTENT_HOLE)) {
+		group = (ext.e_start + ext.e_len - 1 - sbi->s_offset_group) /
+		    sbi->s_group_size;
+		if (group < sbi->s_num_groups)
+			return group;
+	}
+
+	if (!S_ISREG(inode->i_mode) || end + n <= JBFS_STREAM_BLOCKS)
+		return inode->i_ino >> sbi->s_local_inode_bits;
+
+	*stream = 1;
+	group = this_cpu_read(*sbi->s_alloc_rotor);
+	return group < sbi->s_num_groups ? group : 0;
+}
+
+/*
+ * On success, the group containing the returned block is left locked.
+ */
+static uint64_t jbfs_find_free(struct inode *inode, int *n, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t start, group, block;
+	int stream;
+
+	start = jbfs_goal_group(inode, *n, &stream);
+	group = start;
+
+	*err = -ENOSPC;
+	block = 0;
+
+	do {
+		/*
+		 * Full groups are skipped without taking the lock or reading
+		 * the refmap.
+		 */
+		if (!READ_ONCE(sbi->s_group_info[group].gi_free_blocks))
+			goto next;
+
+		JBFS_GROUP_LOCK(sbi, group);
+
+		block = jbfs_find_free_in_group(sb, group, n, err);
+		if (block)
+			break;
+
+		JBFS_GROUP_UNLOCK(sbi, group);
+
+		if (*err != -ENOSPC)
+			break;
+ next:
+		if (++group >= sbi->s_num_groups)
+			group = 0;
+	} while (group != start);
+
+	/*
+	 * Leave the rotor where the stream found space, so the next stream
+	 * on this CPU doesn't have to skip the full groups again.
+	 */
+	if (block && stream)
+		this_cpu_write(*sbi->s_alloc_rotor, group);
+
+	return block;
+}
+
+/*
+ * Blocks written with delayed allocation are reserved when the page is
+ * dirtied and only allocated at writeback. The reserved blocks of an inode
+ * always directly follow its last allocated block, so a plain count per inode
+ * is enough to track them.
+ *
+ * The per-CPU free block counter can be off by up to JBFS_COUNTER_SLACK
+ * blocks, so the exact count is only summed when that close to running out.
+ */
+#define JBFS_COUNTER_SLACK ((int64_t)percpu_counter_batch * num_online_cpus())
+
+static int jbfs_has_free_blocks(struct jbfs_sb_info *sbi, uint64_t n)
+{
+	int64_t free = percpu_counter_read_positive(&sbi->s_free_blocks);
+	int64_t reserved = atomic64_read(&sbi->s_reserved_blocks);
+
+	if (free - reserved < (int64_t)n + JBFS_COUNTER_SLACK)
+		free = percpu_counter_sum_positive(&sbi->s_free_blocks);
+
+	return free - reserved >= (int64_t)n;
+}
+
+/*
+ * Free blocks that aren't reserved for delayed allocation or preallocation
+ * windows, approximately.
+ */
+uint64_t jbfs_avail_blocks(struct jbfs_sb_info *sbi)
+{
+	int64_t free = percpu_counter_read_positive(&sbi->s_free_blocks);
+	int64_t reserved = atomic64_read(&sbi->s_reserved_blocks);
+
+	return max_t(int64_t, free - reserved, 0);
+}
+
+/*
+ * Regular files that keep growing get a preallocation window: a run of free
+ * blocks directly after their last extent that is taken out of the free run
+ * index, but not marked in the refmap. Other inodes can't allocate from it,
+ * so appends from concurrent writers don't interleave. The window doubles in
+ * size every time it is used up, and whatever is left of it is given back
+ * when the file is closed, truncated or evicted. Since the refmap is never
+ * touched, nothing leaks if the system crashes with windows outstanding.
+ *
+ * Free blocks outside of the index can't be found by other inodes, so
+ * windows are counted in s_reserved_blocks like delayed allocation, and are
+ * only grabbed when enough unreserved space is left.
+ *
+ * Window state is protected by the extent lock of the inode.
+ */
+static void jbfs_grab_window(struct inode *inode, uint64_t start,
+			     uint32_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_group_info *gi;
+	struct jbfs_free_extent *fe;
+	uint64_t group, local;
+
+	group = (start - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (start - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+
+	if (start >= sbi->s_num_blocks || local >= sbi->s_group_data_blocks)
+		return;
+
+	gi = &sbi->s_group_info[group];
+	JBFS_GROUP_LOCK(sbi, group);
+
+	if (jbfs_load_group(sb, group))
+		goto out;
+
+	fe = jbfs_free_lookup(gi, local);
+	if (!fe)
+		goto out;
+
+	if (len > fe->fe_start + fe->fe_len - local)
+		len = fe->fe_start + fe->fe_len - local;
+
+	jbfs_free_take(gi, fe, local, len);
+	if (!gi->gi_loaded)
+		goto out;
+
+	atomic64_add(len, &sbi->s_reserved_blocks);
+	ji->i_window_start = start;
+	ji->i_window_len = len;
+	ji->i_window_gen = gi->gi_generation;
+ out:
+	JBFS_GROUP_UNLOCK(sbi, group);
+}
+
+void jbfs_discard_window(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_group_info *gi;
+	uint64_t group, local;
+
+	if (!ji->i_window_len)
+		return;
+
+	group = (ji->i_window_start - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (ji->i_window_start - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+	gi = &sbi->s_group_info[group];
+
+	JBFS_GROUP_LOCK(sbi, group);
+
+	/*
+	 * If the index was rebuilt in the meantime, it already contains the
+	 * window.
+	 */
+	if (gi->gi_generation == ji->i_window_gen)
+		jbfs_free_add(gi, local, ji->i_window_len);
+
+	JBFS_GROUP_UNLOCK(sbi, group);
+
+	atomic64_sub(ji->i_window_len, &sbi->s_reserved_blocks);
+	ji->i_window_len = 0;
+}
+
+static int jbfs_alloc_window(struct inode *inode, int n, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint64_t group, local;
+	int count = 0;
+
+	*err = 0;
+
+	group = (ji->i_window_start - sbi->s_offset_group) / sbi->s_group_size;
+	local =
+	    (ji->i_window_start - sbi->s_offset_group) % sbi->s_group_size -
+	    sbi->s_offset_data;
+
+	if (n > ji->i_window_len)
+		n = ji->i_window_len;
+
+	JBFS_GROUP_LOCK(sbi, group);
+
+	if (sbi->s_group_info[group].gi_generation != ji->i_window_gen) {
+		atomic64_sub(ji->i_window_len, &sbi->s_reserved_blocks);
+		ji->i_window_len = 0;
+		goto out;
+	}
+
+	count = jbfs_set_refmap(sb, group, local, n, err);
+	if (count)
+		jbfs_count_alloc(sb, group, count);
+
+	if (count < n) {
+		atomic64_sub(ji->i_window_len, &sbi->s_reserved_blocks);
+		ji->i_window_len = 0;
+	} else {
+		atomic64_sub(count, &sbi->s_reserved_blocks);
+		ji->i_window_start += count;
+		ji->i_window_len -= count;
+	}
+ out:
+	JBFS_GROUP_UNLOCK(sbi, group);
+	return count;
+}
+
+static void jbfs_refill_window(struct inode *inode, uint64_t start)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint32_t size;
+
+	if (!S_ISREG(inode->i_mode) || ji->i_window_len)
+		return;
+
+	size = ji->i_window_size ?
+	    min_t(uint32_t, ji->i_window_size * 2, JBFS_MAX_WINDOW) : JBFS_MIN_WINDOW;
+
+	if (!jbfs_has_free_blocks(JBFS_SB(inode->i_sb), size))
+		return;
+
+	jbfs_grab_window(inode, start, size);
+	if (ji->i_window_len)
+		ji->i_window_size = size;
+}
+
+/*
+ * Must be called with the extent lock of the inode held.
+ */
+int jbfs_reserve_blocks(struct inode *inode, uint64_t n)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(inode->i_sb);
+
+	if (!jbfs_has_free_blocks(sbi, n))
+		return -ENOSPC;
+
+	atomic64_add(n, &sbi->s_reserved_blocks);
+	JBFS_I(inode)->i_reserved += n;
+	return 0;
+}
+
+/*
+ * Must be called with the extent lock of the inode held.
+ */
+void jbfs_release_blocks(struct inode *inode, uint64_t n)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(inode->i_sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+
+	if (n > ji->i_reserved)
+		n = ji->i_reserved;
+
+	atomic64_sub(n, &sbi->s_reserved_blocks);
+	ji->i_reserved -= n;
+}
+
+/*
+ * Allocate a run of up to *n blocks anywhere, without adding it to the extent
+ * list. Sets *n to the length of the run.
+ */
+uint64_t jbfs_alloc_run(struct inode *inode, int *n, int *err)
+{
+	uint64_t start;
+
+	if (*n <= 0) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	/*
+	 * Space reserved by delayed allocation is only available to the
+	 * inode that reserved it.
+	 */
+	if (!JBFS_I(inode)->i_reserved &&
+	    !jbfs_has_free_blocks(JBFS_SB(inode->i_sb), 1)) {
+		*err = -ENOSPC;
+		return 0;
+	}
+
+	start = jbfs_find_free(inode, n, err);
+	if (!start)
+		return 0;
+
+	*n = jbfs_alloc_blocks(inode->i_sb, start, *n, err, 0);
+	if (!*n)
+		return 0;
+
+	*err = 0;
+	return start;
+}
+
+/*
+ * Allocate up to *n blocks at the end of the file, as a written or unwritten
+ * extent depending on flags. Returns the first block of a contiguous run and
+ * sets *n to the number of blocks in that run, which may be less than
+ * requested.
+ */
+uint64_t jbfs_new_blocks(struct inode *inode, int *n, uint64_t flags, int *err)
+{
+	struct jbfs_inode_info *jbfs_inode = JBFS_I(inode);
+	struct jbfs_extent ext;
+	uint64_t start, end;
+	int count = 0;
+	int ret;
+
+	if (*n <= 0) {
+		*err = -EINVAL;
+		return 0;
+	}
+
+	/*
+	 * Space reserved by delayed allocation or held in a preallocation
+	 * window is only available to the inode that reserved it.
+	 */
+	if (!jbfs_inode->i_reserved && !jbfs_inode->i_window_len &&
+	    !jbfs_has_free_blocks(JBFS_SB(inode->i_sb), 1)) {
+		*err = -ENOSPC;
+		return 0;
+	}
+
+	*err = jbfs_extent_end(inode, &end);
+	if (!*err && end)
+		*err = jbfs_extent_lookup(inode, end - 1, &ext);
+	if (*err)
+		return 0;
+
+	/*
+	 * First, try extending previous extent, if it is of the same kind.
+	 */
+	if (end && ext.e_flags == flags) {
+		start = ext.e_start + ext.e_len;
+
+		if (jbfs_inode->i_window_len &&
+		    jbfs_inode->i_window_start == start) {
+			count = jbfs_alloc_window(inode, *n, err);
+			if (*err)
+				return 0;
+		} else {
+			jbfs_discard_window(inode);
+		}
+
+		if (!count)
+			count = jbfs_alloc_blocks(inode->i_sb, start, *n, err,
+						  1);
+		if (count)
+			goto out;
+	}
+
+	/*
+	 * Otherwise, start a new extent.
+	 */
+	count = *n;
+	start = jbfs_alloc_run(inode, &count, err);
+	if (!start)
+		return 0;
+
+ out:
+	*err = jbfs_extent_set(inode, end, count, start, flags, 0);
+	if (*err) {
+		jbfs_dealloc_blocks(inode->i_sb, start, count, &ret);
+		return 0;
+	}
+
+	*n = count;
+	jbfs_release_blocks(inode, count);
+	jbfs_refill_window(inode, start + count);
+	return start;
+}
+
+// TODO: Error handling?
+void jbfs_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint64_t size =
+	    (inode->i_size + sb->s_blocksize - 1) >> sbi->s_log_block_size;
+	uint64_t allocated;
+	int ret;
+
+	if (S_ISREG(inode->i_mode))
+		iomap_truncate_page(inode, inode->i_size, NULL,
+				    &jbfs_iomap_ops);
+	else
+		block_truncate_page(inode->i_mapping, inode->i_size,
+				    jbfs_get_block);
+
+	mutex_lock(&ji->i_extent_lock);
+
+	jbfs_discard_window(inode);
+
+	ret = jbfs_extent_truncate(inode, size);
+	if (!ret)
+		ret = jbfs_extent_end(inode, &allocated);
+	if (ret)
+		printk(KERN_WARNING
+		       "jbfs: truncating inode %lu failed with code %d\n",
+		       inode->i_ino, ret);
+
+	/*
+	 * Delayed blocks past the new end of the file are no longer needed.
+	 */
+	if (!ret && allocated + ji->i_reserved > size)
+		jbfs_release_blocks(inode, allocated + ji->i_reserved -
+				    max(size, allocated));
+
+	mutex_unlock(&ji->i_extent_lock);
+
+	inode->i_mtime = inode->i_ctime = current_time(inode);
 	mark_inode_dirty(inode);
 }
+
+/*
+ * Return the first free run that ends after local, or NULL if there is none.
+ */
+static struct rb_node *jbfs_free_first_after(struct jbfs_group_info *gi,
+					     uint32_t local)
+{
+	struct rb_node *node = gi->gi_free_by_start.rb_node;
+	struct rb_node *found = NULL;
+
+	while (node) {
+		struct jbfs_free_extent *fe =
+		    rb_entry(node, struct jbfs_free_extent, fe_start_node);
+
+		if (fe->fe_start + fe->fe_len > local) {
+			found = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return found;
+}
+
+#define JBFS_TRIM_BATCH 64
+
+/*
+ * Discard the free runs of at least minlen blocks in [first, last] of a
+ * group, a batch at a time. Like runs waiting for an online discard, a batch
+ * is taken out of the free run index and marked as used in the summary
+ * while the group is locked, so it can't be allocated while the discards are
+ * issued without the lock. Afterwards, the runs are freed again.
+ */
+static uint64_t jbfs_trim_group(struct super_block *sb, uint64_t group,
+				uint32_t first, uint32_t last, uint32_t minlen,
+				int *err)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_group_info *gi = &sbi->s_group_info[group];
+	uint32_t runs[JBFS_TRIM_BATCH][2];
+	uint64_t base, trimmed = 0;
+	uint32_t next = first;
+	struct rb_node *node;
+	int i, nr, ret;
+
+	base = sbi->s_offset_group + group * sbi->s_group_size +
+	    sbi->s_offset_data;
+
+	*err = 0;
+	while (next <= last && !*err) {
+		JBFS_GROUP_LOCK(sbi, group);
+
+		*err = jbfs_load_group(sb, group);
+		if (*err) {
+			JBFS_GROUP_UNLOCK(sbi, group);
+			break;
+		}
+
+		nr = 0;
+		node = jbfs_free_first_after(gi, next);
+		while (node && nr < JBFS_TRIM_BATCH) {
+			struct jbfs_free_extent *fe =
+			    rb_entry(node, struct jbfs_free_extent,
+				     fe_start_node);
+			uint32_t start = max(fe->fe_start, next);
+			uint32_t end = min(fe->fe_start + fe->fe_len - 1, last);
+
+			if (fe->fe_start > last)
+				break;
+
+			next = end + 1;
+			if (end - start + 1 >= minlen) {
+				runs[nr][0] = start;
+				runs[nr][1] = end - start + 1;
+				nr += 1;
+			}
+			node = rb_next(node);
+		}
+		if (nr < JBFS_TRIM_BATCH)
+			next = last + 1;
+
+		/*
+		 * If taking a run splits it and memory runs out, the index is
+		 * dropped, and the runs after it are skipped. Without the
+		 * summary, a rebuilt index wouldn't know about taken runs, so
+		 * nothing is taken at all.
+		 */
+		for (i = 0; i < nr; ++i) {
+			struct jbfs_free_extent *fe =
+			    jbfs_free_lookup(gi, runs[i][0]);
+
+			if (!fe || !gi->gi_used) {
+				runs[i][1] = 0;
+				continue;
+			}
+			jbfs_free_take(gi, fe, runs[i][0], runs[i][1]);
+			jbfs_summary_set(gi, runs[i][0], runs[i][1]);
+		}
+
+		JBFS_GROUP_UNLOCK(sbi, group);
+
+		for (i = 0; i < nr; ++i) {
+			if (!runs[i][1] || *err)
+				continue;
+
+			ret = sb_issue_discard(sb, base + runs[i][0],
+					       runs[i][1], GFP_NOFS, 0);
+			if (ret)
+				*err = ret;
+			else
+				trimmed += runs[i][1];
+		}
+
+		JBFS_GROUP_LOCK(sbi, group);
+		for (i = 0; i < nr; ++i) {
+			if (runs[i][1])
+				jbfs_free_add_loaded(gi, runs[i][0],
+						     runs[i][1]);
+		}
+		JBFS_GROUP_UNLOCK(sbi, group);
+
+		if (!*err && fatal_signal_pending(current))
+			*err = -ERESTARTSYS;
+
+		cond_resched();
+	}
+
+	return trimmed;
+}
+
+/*
+ * Discard the free space in the byte range described by range, group by
+ * group. On return, range->len holds the number of bytes discarded.
+ */
+int jbfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	unsigned int bits = sb->s_blocksize_bits;
+	uint64_t start = range->start >> bits;
+	uint64_t len = range->len >> bits;
+	uint64_t end, group, trimmed = 0;
+	uint32_t minlen;
+	int err = 0;
+
+	if (!len || start >= sbi->s_num_blocks)
+		return -EINVAL;
+
+	end = len >= sbi->s_num_blocks - start ?
+	    sbi->s_num_blocks - 1 : start + len - 1;
+	minlen = clamp_t(uint64_t, range->minlen >> bits, 1,
+			 sbi->s_group_data_blocks);
+
+	for (group = 0; group < sbi->s_num_groups; ++group) {
+		uint64_t base = sbi->s_offset_group +
+		    group * sbi->s_group_size + sbi->s_offset_data;
+
+		if (base + sbi->s_group_data_blocks <= start)
+			continue;
+		if (base > end)
+			break;
+		if (!READ_ONCE(sbi->s_group_info[group].gi_free_blocks))
+			continue;
+
+		trimmed += jbfs_trim_group(sb, group,
+					   start > base ? start - base : 0,
+					   min_t(uint64_t, end - base,
+						 sbi->s_group_data_blocks - 1),
+					   minlen, &err);
+		if (err)
+			break;
+	}
+
+	range->len = trimmed << bits;
+	return err;
+}
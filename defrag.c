@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2020, 2021 Julian Blaauboer
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/pagemap.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include "jbfs.h"
+
+/*
+ * Online defragmentation moves a file a run of written extents at a time.
+ * All page cache pages of the run are read in and locked, so neither
+ * writeback nor page faults can touch them. A new contiguous run of blocks is
+ * then allocated and the data is written to it from the locked pages. Only
+ * once that is on disk is the extent list pointed at the new run and the old
+ * blocks freed, so a crash leaves the file at its old location.
+ *
+ * Holes and unwritten extents are left alone.
+ */
+#define JBFS_DEFRAG_BLOCKS 2048
+
+/*
+ * Count the written extents in the run starting at lblock, up to max blocks,
+ * and set *len to the length of the run. If lblock is not in a written
+ * extent, 0 is returned and *len is set to the number of blocks to skip.
+ * Must be called with the extent lock of the inode held.
+ */
+static int jbfs_defrag_scan(struct inode *inode, uint64_t lblock,
+			    uint64_t max, uint64_t *len, uint64_t *count)
+{
+	struct jbfs_extent ext;
+	uint64_t pos = lblock;
+	int ret;
+
+	*count = 0;
+	while (pos < lblock + max) {
+		ret = jbfs_extent_lookup(inode, pos, &ext);
+		if (ret == -ENOENT)
+			break;
+		if (ret)
+			return ret;
+
+		if (ext.e_flags) {
+			if (pos == lblock)
+				pos = ext.e_lblock + ext.e_len;
+			break;
+		}
+
+		*count += 1;
+		pos = ext.e_lblock + ext.e_len;
+	}
+
+	*len = min(pos, lblock + max) - lblock;
+	return 0;
+}
+
+/*
+ * Write [lblock, lblock + n) from the locked pages to the run starting at
+ * start, and wait until it is on disk.
+ */
+static int jbfs_defrag_copy(struct inode *inode, struct page **pages,
+			    pgoff_t first, uint64_t lblock, uint64_t n,
+			    uint64_t start)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t pos = (loff_t)lblock << blkbits;
+	loff_t end = (loff_t)(lblock + n) << blkbits;
+	struct bio *bio = NULL;
+	int ret;
+
+	while (pos < end) {
+		struct page *page = pages[(pos >> PAGE_SHIFT) - first];
+		unsigned int off = offset_in_page(pos);
+		unsigned int len = min_t(loff_t, PAGE_SIZE - off, end - pos);
+
+		if (!bio) {
+			bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+			bio_set_dev(bio, inode->i_sb->s_bdev);
+			bio->bi_iter.bi_sector =
+			    (start + (pos >> blkbits) - lblock) <<
+			    (blkbits - 9);
+			bio->bi_opf = REQ_OP_WRITE | REQ_SYNC | REQ_FUA;
+		}
+
+		if (bio_add_page(bio, page, len, off) < len) {
+			ret = submit_bio_wait(bio);
+			bio_put(bio);
+			bio = NULL;
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		pos += len;
+	}
+
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+	return ret;
+}
+
+/*
+ * Move [lblock, lblock + len) to a single new run of blocks. If no free run
+ * is found that would reduce the number of extents, nothing is moved. The
+ * caller holds the inode lock, which together with the page locks keeps the
+ * extents of the run from changing while the data is copied.
+ */
+static int jbfs_defrag_run(struct inode *inode, uint64_t lblock, uint64_t len,
+			   uint64_t *moved)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	unsigned int bits = PAGE_SHIFT - inode->i_blkbits;
+	pgoff_t first = lblock >> bits;
+	pgoff_t last = (lblock + len - 1) >> bits;
+	struct page **pages;
+	uint64_t start, count, run;
+	uint32_t seq;
+	int nr = last - first + 1;
+	int i, n, err;
+	int ret = 0;
+
+	*moved = 0;
+
+	pages = kmalloc_array(nr, sizeof(*pages), GFP_NOFS);
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; ++i) {
+		pages[i] = read_mapping_page(mapping, first + i, NULL);
+		if (IS_ERR(pages[i])) {
+			ret = PTR_ERR(pages[i]);
+			goto out_pages;
+		}
+
+		lock_page(pages[i]);
+		wait_on_page_writeback(pages[i]);
+		if (pages[i]->mapping != mapping) {
+			unlock_page(pages[i]);
+			put_page(pages[i]);
+			ret = -EAGAIN;
+			goto out_pages;
+		}
+	}
+
+	mutex_lock(&ji->i_extent_lock);
+
+	n = len;
+	start = jbfs_alloc_run(inode, &n, &ret);
+	if (!start) {
+		mutex_unlock(&ji->i_extent_lock);
+		goto out_pages;
+	}
+
+	ret = jbfs_defrag_scan(inode, lblock, n, &run, &count);
+	if (ret || count <= 1) {
+		mutex_unlock(&ji->i_extent_lock);
+		goto out_dealloc;
+	}
+
+	/*
+	 * The run may have come out shorter than asked for; only move the
+	 * written extents that fit in it, and give back the rest.
+	 */
+	if (run < n) {
+		jbfs_dealloc_blocks(inode->i_sb, start + run, n - run, &err);
+		n = run;
+	}
+
+	seq = ji->i_extent_seq;
+	mutex_unlock(&ji->i_extent_lock);
+
+	/*
+	 * Pages past the final run are not needed.
+	 */
+	last = (lblock + n - 1) >> bits;
+	while (nr > last - first + 1) {
+		nr -= 1;
+		unlock_page(pages[nr]);
+		put_page(pages[nr]);
+	}
+
+	ret = jbfs_defrag_copy(inode, pages, first, lblock, n, start);
+	if (ret)
+		goto out_dealloc;
+
+	mutex_lock(&ji->i_extent_lock);
+
+	/*
+	 * Nothing should have remapped the run in the meantime, but if
+	 * anything did, leave it alone.
+	 */
+	if (ji->i_extent_seq != seq) {
+		mutex_unlock(&ji->i_extent_lock);
+		goto out_dealloc;
+	}
+
+	ret = jbfs_extent_set(inode, lblock, n, start, 0, 1);
+	mutex_unlock(&ji->i_extent_lock);
+	if (ret)
+		goto out_dealloc;
+
+	*moved = n;
+	i = nr;
+	goto out_pages;
+
+ out_dealloc:
+	jbfs_dealloc_blocks(inode->i_sb, start, n, &err);
+	i = nr;
+
+ out_pages:
+	while (i--) {
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+	kfree(pages);
+	return ret == -ENOSPC ? 0 : ret;
+}
+
+int jbfs_defrag(struct file *file, struct jbfs_defrag_range *range)
+{
+	struct inode *inode = file_inode(file);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint64_t lblock, end, size, len, count, moved;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode) || IS_SWAPFILE(inode))
+		return -EINVAL;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (IS_IMMUTABLE(inode) || IS_APPEND(inode))
+		return -EPERM;
+
+	range->moved = 0;
+
+	inode_lock(inode);
+	inode_dio_wait(inode);
+
+	/*
+	 * Write back dirty data first, which also allocates any delayed
+	 * blocks.
+	 */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		goto out;
+
+	size = (i_size_read(inode) + i_blocksize(inode) - 1) >>
+	    inode->i_blkbits;
+	lblock = range->start;
+	end = size;
+	if (range->len && lblock < size && range->len < size - lblock)
+		end = lblock + range->len;
+
+	while (lblock < end) {
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		mutex_lock(&ji->i_extent_lock);
+		ret = jbfs_defrag_scan(inode, lblock,
+				       min_t(uint64_t, end - lblock,
+					     JBFS_DEFRAG_BLOCKS), &len, &count);
+		mutex_unlock(&ji->i_extent_lock);
+		if (ret)
+			break;
+
+		if (!len)
+			break;
+
+		if (count <= 1) {
+			lblock += len;
+			continue;
+		}
+
+		ret = jbfs_defrag_run(inode, lblock, len, &moved);
+		if (ret)
+			break;
+
+		if (!moved)
+			moved = len;
+		else
+			range->moved += moved;
+		lblock += moved;
+
+		cond_resched();
+	}
+
+ out:
+	inode_unlock(inode);
+	return ret;
+}
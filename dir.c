@@ -3,10 +3,17 @@
 // Copyright (C) 1192, 1993, 1994, 1995 Remy Card
 // Copyright (C) 2020, 2021 Julian Blaauboer
 
+#include <linux/blkdev.h>
 #include <linux/fs.h>
 #include <linux/iversion.h>
 #include "jbfs.h"
 
+/*
+ * Bounds on the number of inodes read ahead for lookups in directory order.
+ */
+#define JBFS_RA_MIN_INODES 4
+#define JBFS_RA_MAX_INODES 64
+
 static int dir_check_page(struct page *page)
 {
 	struct inode *dir = page->mapping->host;
@@ -106,6 +113,69 @@ static unsigned last_byte(struct inode *inode, unsigned long page_nr)
 	return last > PAGE_SIZE ? PAGE_SIZE : last;
 }
 
+/*
+ * Start reading the inodes of up to max entries of a directory page, from de
+ * on, so that stat()ing them doesn't wait for each of them in turn. Returns
+ * the position in the directory after the last entry looked at.
+ */
+static loff_t dir_readahead_inodes(struct inode *dir, struct page *page,
+				   struct jbfs_dirent *de, unsigned int max)
+{
+	char *kaddr = page_address(page);
+	char *limit = kaddr + last_byte(dir, page->index) - JBFS_DIRENT_SIZE(1);
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	while ((char *)de <= limit && max) {
+		uint16_t size = le16_to_cpu(de->d_size);
+		if (size == 0)
+			break;
+		if (de->d_ino) {
+			jbfs_inode_readahead(dir->i_sb, le64_to_cpu(de->d_ino));
+			max -= 1;
+		}
+		de = (struct jbfs_dirent *)((char *)de + size);
+	}
+	blk_finish_plug(&plug);
+
+	return page_offset(page) + ((char *)de - kaddr);
+}
+
+/*
+ * Lookups that walk a directory in order, as ls -l or rsync do after reading
+ * it, read ahead the inodes of the entries that follow. The number of entries
+ * doubles for as long as the pattern holds, and drops back to none as soon as
+ * a lookup goes backwards. The state is only a hint, so parallel lookups
+ * don't serialise on it.
+ */
+static void dir_lookup_readahead(struct inode *dir, struct page *page,
+				 struct jbfs_dirent *de)
+{
+	struct jbfs_inode_info *ji = JBFS_I(dir);
+	uint64_t pos = page_offset(page) +
+	    ((char *)de - (char *)page_address(page));
+	uint32_t window = READ_ONCE(ji->i_ra_window);
+
+	if (pos <= READ_ONCE(ji->i_ra_pos)) {
+		window = 0;
+		WRITE_ONCE(ji->i_ra_next, 0);
+	} else if (window) {
+		window = min_t(uint32_t, window * 2, JBFS_RA_MAX_INODES);
+	} else {
+		window = JBFS_RA_MIN_INODES;
+	}
+
+	WRITE_ONCE(ji->i_ra_pos, pos);
+	WRITE_ONCE(ji->i_ra_window, window);
+
+	if (window && pos >= READ_ONCE(ji->i_ra_next)) {
+		de = (struct jbfs_dirent *)((char *)de +
+					    le16_to_cpu(de->d_size));
+		WRITE_ONCE(ji->i_ra_next,
+			   dir_readahead_inodes(dir, page, de, window));
+	}
+}
+
 static int commit_chunk(struct page *page, loff_t pos, unsigned len)
 {
 	struct address_space *mapping = page->mapping;
@@ -462,6 +532,7 @@ ino_t jbfs_inode_by_name(struct dentry *dentry)
 
 	if (!IS_ERR(de)) {
 		ino = de->d_ino;
+		dir_lookup_readahead(d_inode(dentry->d_parent), page, de);
 		dir_put_page(page);
 		return ino;
 	}
@@ -496,6 +567,11 @@ static int jbfs_readdir(struct file *file, struct dir_context *ctx)
 		de = (struct jbfs_dirent *)(kaddr + offset);
 		limit = kaddr + last_byte(inode, n) - JBFS_DIRENT_SIZE(1);
 
+		/*
+		 * The entries are likely to be stat()ed next.
+		 */
+		dir_readahead_inodes(inode, page, de, UINT_MAX);
+
 		while ((char *)de <= limit) {
 			uint16_t size = le16_to_cpu(de->d_size);
 			if (size == 0) {
@@ -526,5 +602,7 @@ const struct file_operations jbfs_dir_operations = {
 	.llseek = generic_file_llseek,
 	.read = generic_read_dir,
 	.iterate_shared = jbfs_readdir,
-	.fsync = generic_file_fsync
+	.fsync = generic_file_fsync,
+	.unlocked_ioctl = jbfs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
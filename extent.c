@@ -0,0 +1,1602 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2020, 2021 Julian Blaauboer
+
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include "jbfs.h"
+
+/*
+ * Editing a range can split at most two extents and add a hole before it.
+ */
+#define JBFS_EDIT_EXTENTS (12 + 3)
+
+/*
+ * The extent list of an inode is stored as up to 12 [start, end] pairs of
+ * physical blocks, each one logically following the previous one. Holes and
+ * unwritten extents are marked by flag bits that are set in both words, so
+ * end - start + 1 is the length of any extent. A hole has no physical blocks;
+ * an unwritten extent has blocks, but reads as zeroes.
+ *
+ * Once an edit no longer fits in the inode, the list is moved into a B+tree
+ * rooted at i_cont and the inline pairs are cleared. Leaves of the tree store
+ * extents with an explicit logical start, so holes are simply left out; index
+ * nodes store the first logical block and location of each child. The root
+ * stays in the same block for the lifetime of the tree, growing in depth when
+ * it is split, and is freed again once the tree becomes empty. While there is
+ * a tree, i_tree_blocks counts its nodes and the blocks of its extents.
+ *
+ * All functions here must be called with the extent lock of the inode held.
+ */
+
+static void jbfs_decode_extent(const uint64_t raw[2], uint64_t lblock,
+			       struct jbfs_extent *ext)
+{
+	ext->e_lblock = lblock;
+	ext->e_flags = raw[0] & JBFS_EXTENT_FLAGS;
+	ext->e_start = raw[0] & ~JBFS_EXTENT_FLAGS;
+	ext->e_len = raw[1] - raw[0] + 1;
+}
+
+static void jbfs_encode_extent(const struct jbfs_extent *ext, uint64_t raw[2])
+{
+	raw[0] = ext->e_start | ext->e_flags;
+	raw[1] = (ext->e_start + ext->e_len - 1) | ext->e_flags;
+}
+
+/*
+ * The inline list only records extent lengths, so finding an extent means
+ * adding up every extent before it. Each inode keeps a decoded copy of the
+ * list with logical starts filled in, along with the number of mapped blocks,
+ * so lookups can binary search it and stat doesn't have to add up anything.
+ * The copy is rebuilt whenever the inline list changes, and dropped when the
+ * list moves into a tree. Caches are reclaimed under memory pressure and
+ * built again on the next lookup.
+ */
+struct jbfs_extent_cache {
+	struct list_head ec_list;
+	struct inode *ec_inode;
+	int ec_referenced;
+	int ec_count;
+	uint64_t ec_end;
+	uint64_t ec_blocks;
+	struct jbfs_extent ec_extents[12];
+};
+
+static void jbfs_fill_extent_cache(struct inode *inode,
+				   struct jbfs_extent_cache *ec)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_extent *ext;
+	uint64_t pos = 0;
+	int i;
+
+	ec->ec_blocks = 0;
+	for (i = 0; i < 12 && ji->i_extents[i][0]; ++i) {
+		ext = &ec->ec_extents[i];
+		jbfs_decode_extent(ji->i_extents[i], pos, ext);
+		pos += ext->e_len;
+		if (!(ext->e_flags & JBFS_EXTENT_HOLE))
+			ec->ec_blocks += ext->e_len;
+	}
+
+	ec->ec_count = i;
+	ec->ec_end = pos;
+}
+
+static struct jbfs_extent_cache *jbfs_get_extent_cache(struct inode *inode)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(inode->i_sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_extent_cache *ec = ji->i_ecache;
+
+	if (ec) {
+		WRITE_ONCE(ec->ec_referenced, 1);
+		return ec;
+	}
+
+	ec = kmalloc(sizeof(*ec), GFP_NOFS);
+	if (!ec)
+		return NULL;
+
+	ec->ec_inode = inode;
+	ec->ec_referenced = 1;
+	jbfs_fill_extent_cache(inode, ec);
+
+	spin_lock(&sbi->s_ecache_lock);
+	list_add_tail(&ec->ec_list, &sbi->s_ecache_list);
+	sbi->s_ecache_count += 1;
+	spin_unlock(&sbi->s_ecache_lock);
+
+	ji->i_ecache = ec;
+	return ec;
+}
+
+/*
+ * Must be called with s_ecache_lock held.
+ */
+static void jbfs_free_extent_cache(struct jbfs_sb_info *sbi,
+				   struct jbfs_extent_cache *ec)
+{
+	JBFS_I(ec->ec_inode)->i_ecache = NULL;
+	list_del(&ec->ec_list);
+	sbi->s_ecache_count -= 1;
+	kfree(ec);
+}
+
+/*
+ * Must be called with the extent lock of the inode held, or while the inode
+ * is being evicted.
+ */
+void jbfs_drop_extent_cache(struct inode *inode)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(inode->i_sb);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+
+	if (!READ_ONCE(ji->i_ecache))
+		return;
+
+	spin_lock(&sbi->s_ecache_lock);
+	if (ji->i_ecache)
+		jbfs_free_extent_cache(sbi, ji->i_ecache);
+	spin_unlock(&sbi->s_ecache_lock);
+}
+
+static unsigned long jbfs_ecache_count(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct jbfs_sb_info *sbi =
+	    container_of(shrink, struct jbfs_sb_info, s_ecache_shrinker);
+
+	return READ_ONCE(sbi->s_ecache_count);
+}
+
+/*
+ * Caches that were used since the last scan get a second chance. Inodes
+ * whose extent lock is held are busy and skipped.
+ */
+static unsigned long jbfs_ecache_scan(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	struct jbfs_sb_info *sbi =
+	    container_of(shrink, struct jbfs_sb_info, s_ecache_shrinker);
+	struct jbfs_extent_cache *ec, *tmp;
+	unsigned long freed = 0;
+	unsigned long nr = sc->nr_to_scan;
+
+	spin_lock(&sbi->s_ecache_lock);
+	list_for_each_entry_safe(ec, tmp, &sbi->s_ecache_list, ec_list) {
+		struct jbfs_inode_info *ji = JBFS_I(ec->ec_inode);
+
+		if (!nr--)
+			break;
+
+		if (ec->ec_referenced) {
+			ec->ec_referenced = 0;
+			list_move_tail(&ec->ec_list, &sbi->s_ecache_list);
+			continue;
+		}
+
+		if (!mutex_trylock(&ji->i_extent_lock))
+			continue;
+
+		jbfs_free_extent_cache(sbi, ec);
+		mutex_unlock(&ji->i_extent_lock);
+		freed += 1;
+	}
+	spin_unlock(&sbi->s_ecache_lock);
+
+	return freed;
+}
+
+int jbfs_init_extent_cache(struct super_block *sb)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+
+	spin_lock_init(&sbi->s_ecache_lock);
+	INIT_LIST_HEAD(&sbi->s_ecache_list);
+	sbi->s_ecache_shrinker.count_objects = jbfs_ecache_count;
+	sbi->s_ecache_shrinker.scan_objects = jbfs_ecache_scan;
+	sbi->s_ecache_shrinker.seeks = DEFAULT_SEEKS;
+	return register_shrinker(&sbi->s_ecache_shrinker);
+}
+
+void jbfs_destroy_extent_cache(struct super_block *sb)
+{
+	unregister_shrinker(&JBFS_SB(sb)->s_ecache_shrinker);
+}
+
+/*
+ * Find the extent containing lblock in the inline list. If lblock lies past
+ * the last extent, -ENOENT is returned and ext->e_lblock is set to the end of
+ * the list.
+ */
+static int jbfs_inline_lookup(struct inode *inode, uint64_t lblock,
+			      struct jbfs_extent *ext)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_extent_cache *ec;
+	uint64_t pos = 0;
+	int lo, hi, i;
+
+	ec = jbfs_get_extent_cache(inode);
+	if (ec) {
+		lo = 0;
+		hi = ec->ec_count;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+
+			if (ec->ec_extents[mid].e_lblock <= lblock)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo && lblock < ec->ec_end) {
+			*ext = ec->ec_extents[lo - 1];
+			return 0;
+		}
+		pos = ec->ec_end;
+		goto out;
+	}
+
+	for (i = 0; i < 12; ++i) {
+		if (!ji->i_extents[i][0])
+			break;
+		jbfs_decode_extent(ji->i_extents[i], pos, ext);
+		if (lblock < pos + ext->e_len)
+			return 0;
+		pos += ext->e_len;
+	}
+
+ out:
+	ext->e_lblock = pos;
+	ext->e_start = 0;
+	ext->e_len = 0;
+	ext->e_flags = 0;
+	return -ENOENT;
+}
+
+static int jbfs_extent_push(struct jbfs_extent *list, int n,
+			    const struct jbfs_extent *ext)
+{
+	struct jbfs_extent *prev;
+
+	if (!ext->e_len || n > JBFS_EDIT_EXTENTS)
+		return n + !!ext->e_len;
+
+	prev = n ? &list[n - 1] : NULL;
+	if (prev && prev->e_flags == ext->e_flags &&
+	    ((ext->e_flags & JBFS_EXTENT_HOLE) ||
+	     prev->e_start + prev->e_len == ext->e_start)) {
+		prev->e_len += ext->e_len;
+		return n;
+	}
+
+	if (n == JBFS_EDIT_EXTENTS)
+		return n + 1;
+
+	list[n] = *ext;
+	return n + 1;
+}
+
+/*
+ * Replace the logical range [lblock, lblock + len) with repl, or cut it out
+ * of the file entirely if repl is NULL, shifting everything after it down.
+ * If release is set, the blocks that used to be mapped in the range are
+ * freed. Adjacent extents are merged and trailing holes are dropped. Nothing
+ * is changed if the result doesn't fit in the inode.
+ */
+static int jbfs_inline_edit(struct inode *inode, uint64_t lblock,
+			    uint64_t len, const struct jbfs_extent *repl,
+			    int release)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_extent list[JBFS_EDIT_EXTENTS];
+	struct jbfs_extent ext, part;
+	uint64_t end = lblock + len;
+	uint64_t pos = 0;
+	int n = 0;
+	int i, err;
+
+	/*
+	 * Everything before the range.
+	 */
+	for (i = 0; i < 12 && ji->i_extents[i][0]; ++i) {
+		jbfs_decode_extent(ji->i_extents[i], pos, &ext);
+		pos += ext.e_len;
+		if (ext.e_lblock >= lblock)
+			break;
+
+		part = ext;
+		if (pos > lblock)
+			part.e_len = lblock - ext.e_lblock;
+		n = jbfs_extent_push(list, n, &part);
+	}
+
+	if (repl) {
+		if (pos < lblock) {
+			part.e_lblock = pos;
+			part.e_start = 0;
+			part.e_len = lblock - pos;
+			part.e_flags = JBFS_EXTENT_HOLE;
+			n = jbfs_extent_push(list, n, &part);
+		}
+		n = jbfs_extent_push(list, n, repl);
+	}
+
+	/*
+	 * Everything after the range.
+	 */
+	pos = 0;
+	for (i = 0; i < 12 && ji->i_extents[i][0]; ++i) {
+		jbfs_decode_extent(ji->i_extents[i], pos, &ext);
+		pos += ext.e_len;
+		if (pos <= end)
+			continue;
+
+		part = ext;
+		if (ext.e_lblock < end) {
+			part.e_len = pos - end;
+			if (!(part.e_flags & JBFS_EXTENT_HOLE))
+				part.e_start += end - ext.e_lblock;
+		}
+		n = jbfs_extent_push(list, n, &part);
+	}
+
+	while (n && n <= JBFS_EDIT_EXTENTS &&
+	       (list[n - 1].e_flags & JBFS_EXTENT_HOLE))
+		n -= 1;
+
+	if (n > 12)
+		return -EFBIG;
+
+	/*
+	 * Free whatever was mapped in the range, before the old list is
+	 * overwritten.
+	 */
+	pos = 0;
+	for (i = 0; release && i < 12 && ji->i_extents[i][0]; ++i) {
+		uint64_t from, to;
+
+		jbfs_decode_extent(ji->i_extents[i], pos, &ext);
+		pos += ext.e_len;
+		if (ext.e_flags & JBFS_EXTENT_HOLE)
+			continue;
+
+		from = max(ext.e_lblock, lblock);
+		to = min(pos, end);
+		if (from < to)
+			jbfs_dealloc_blocks(inode->i_sb,
+					    ext.e_start + from - ext.e_lblock,
+					    to - from, &err);
+	}
+
+	for (i = 0; i < 12; ++i) {
+		if (i < n)
+			jbfs_encode_extent(&list[i], ji->i_extents[i]);
+		else
+			ji->i_extents[i][0] = ji->i_extents[i][1] = 0;
+	}
+
+	if (ji->i_ecache)
+		jbfs_fill_extent_cache(inode, ji->i_ecache);
+
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+struct jbfs_tree_path {
+	struct buffer_head *p_bh;
+	int p_index;
+};
+
+#define JBFS_TREE_HEADER(bh) ((struct jbfs_tree_header *)(bh)->b_data)
+
+static inline int jbfs_tree_entries(struct buffer_head *bh)
+{
+	return le16_to_cpu(JBFS_TREE_HEADER(bh)->th_entries);
+}
+
+static inline int jbfs_tree_is_leaf(struct buffer_head *bh)
+{
+	return !JBFS_TREE_HEADER(bh)->th_depth;
+}
+
+static inline size_t jbfs_tree_esize(struct buffer_head *bh)
+{
+	return jbfs_tree_is_leaf(bh) ? sizeof(struct jbfs_tree_leaf) :
+	    sizeof(struct jbfs_tree_index);
+}
+
+static inline int jbfs_tree_max(struct buffer_head *bh)
+{
+	return (bh->b_size - sizeof(struct jbfs_tree_header)) /
+	    jbfs_tree_esize(bh);
+}
+
+static inline int jbfs_tree_full(struct buffer_head *bh)
+{
+	return jbfs_tree_entries(bh) >= jbfs_tree_max(bh);
+}
+
+static inline void *jbfs_tree_entry(struct buffer_head *bh, int i)
+{
+	return bh->b_data + sizeof(struct jbfs_tree_header) +
+	    i * jbfs_tree_esize(bh);
+}
+
+/*
+ * Both kinds of entries start with their first logical block.
+ */
+static inline uint64_t jbfs_tree_key(struct buffer_head *bh, int i)
+{
+	return le64_to_cpu(*(__le64 *)jbfs_tree_entry(bh, i));
+}
+
+static void jbfs_tree_get(struct buffer_head *bh, int i,
+			  struct jbfs_extent *ext)
+{
+	struct jbfs_tree_leaf *tl = jbfs_tree_entry(bh, i);
+	uint64_t start = le64_to_cpu(tl->tl_start);
+
+	ext->e_lblock = le64_to_cpu(tl->tl_lblock);
+	ext->e_flags = start & JBFS_EXTENT_FLAGS;
+	ext->e_start = start & ~JBFS_EXTENT_FLAGS;
+	ext->e_len = le64_to_cpu(tl->tl_len);
+}
+
+static void jbfs_tree_encode(const struct jbfs_extent *ext,
+			     struct jbfs_tree_leaf *tl)
+{
+	tl->tl_lblock = cpu_to_le64(ext->e_lblock);
+	tl->tl_start = cpu_to_le64(ext->e_start | ext->e_flags);
+	tl->tl_len = cpu_to_le64(ext->e_len);
+}
+
+static void jbfs_tree_release(struct jbfs_tree_path *path, int depth)
+{
+	int l;
+
+	for (l = 0; l <= depth; ++l) {
+		brelse(path[l].p_bh);
+		path[l].p_bh = NULL;
+	}
+}
+
+/*
+ * Read a tree node and check that it is sane. A depth of -1 accepts a node
+ * of any depth, which is needed for the root.
+ */
+static struct buffer_head *jbfs_tree_read(struct inode *inode, uint64_t block,
+					  int depth, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct jbfs_tree_header *th;
+	struct buffer_head *bh;
+
+	*err = -EIO;
+	if (block >= JBFS_SB(sb)->s_num_blocks)
+		goto corrupt;
+
+	bh = sb_bread(sb, block);
+	if (!bh) {
+		printk(KERN_ERR "jbfs: unable to read extent tree block %llu\n",
+		       block);
+		return NULL;
+	}
+
+	th = JBFS_TREE_HEADER(bh);
+	if (le32_to_cpu(th->th_magic) != JBFS_TREE_MAGIC ||
+	    le16_to_cpu(th->th_depth) >= JBFS_TREE_MAX_DEPTH ||
+	    (depth >= 0 && le16_to_cpu(th->th_depth) != depth) ||
+	    jbfs_tree_entries(bh) > jbfs_tree_max(bh) ||
+	    (!jbfs_tree_is_leaf(bh) && !jbfs_tree_entries(bh))) {
+		brelse(bh);
+		goto corrupt;
+	}
+
+	*err = 0;
+	return bh;
+
+ corrupt:
+	printk(KERN_ERR "jbfs: corrupt extent tree block %llu in inode %lu\n",
+	       block, inode->i_ino);
+	return NULL;
+}
+
+/*
+ * Index of the last entry of a node starting at or before lblock, or -1 if
+ * there is none.
+ */
+static int jbfs_tree_search(struct buffer_head *bh, uint64_t lblock)
+{
+	int lo = 0, hi = jbfs_tree_entries(bh);
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (jbfs_tree_key(bh, mid) <= lblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/*
+ * Walk down to the leaf that would contain lblock. The leaf index in the path
+ * is set to the last extent starting at or before lblock, or -1. On error,
+ * nothing is left in the path.
+ */
+static int jbfs_tree_find(struct inode *inode, uint64_t lblock,
+			  struct jbfs_tree_path *path, int *depth)
+{
+	struct buffer_head *bh;
+	int level = 0;
+	int i, err;
+
+	bh = jbfs_tree_read(inode, JBFS_I(inode)->i_cont, -1, &err);
+	if (!bh)
+		return err;
+
+	*depth = le16_to_cpu(JBFS_TREE_HEADER(bh)->th_depth);
+
+	for (;;) {
+		struct jbfs_tree_index *ti;
+
+		i = jbfs_tree_search(bh, lblock);
+		path[level].p_bh = bh;
+		if (level == *depth) {
+			path[level].p_index = i;
+			return 0;
+		}
+
+		path[level].p_index = max(i, 0);
+		ti = jbfs_tree_entry(bh, path[level].p_index);
+		bh = jbfs_tree_read(inode, le64_to_cpu(ti->ti_block),
+				    *depth - level - 1, &err);
+		if (!bh) {
+			jbfs_tree_release(path, level);
+			return err;
+		}
+		level += 1;
+	}
+}
+
+/*
+ * Move the path to the first entry of the next leaf. Returns 1 if there is
+ * one, 0 if the path was at the last leaf and a negative error otherwise.
+ */
+static int jbfs_tree_next(struct inode *inode, struct jbfs_tree_path *path,
+			  int depth)
+{
+	int l, err;
+
+	for (l = depth - 1; l >= 0; --l)
+		if (path[l].p_index + 1 < jbfs_tree_entries(path[l].p_bh))
+			break;
+
+	if (l < 0)
+		return 0;
+
+	path[l].p_index += 1;
+	for (++l; l <= depth; ++l) {
+		struct jbfs_tree_index *ti =
+		    jbfs_tree_entry(path[l - 1].p_bh, path[l - 1].p_index);
+
+		brelse(path[l].p_bh);
+		path[l].p_bh = jbfs_tree_read(inode, le64_to_cpu(ti->ti_block),
+					      depth - l, &err);
+		path[l].p_index = 0;
+		if (!path[l].p_bh)
+			return err;
+	}
+
+	return 1;
+}
+
+/*
+ * Move the path to the next extent, see jbfs_tree_next.
+ */
+static int jbfs_tree_advance(struct inode *inode, struct jbfs_tree_path *path,
+			     int depth)
+{
+	if (++path[depth].p_index < jbfs_tree_entries(path[depth].p_bh))
+		return 1;
+
+	return jbfs_tree_next(inode, path, depth);
+}
+
+/*
+ * Position the path at the first extent starting at or after lblock. Returns
+ * 1 if there is one and 0 if not. The path has to be released in both cases.
+ */
+static int jbfs_tree_seek(struct inode *inode, uint64_t lblock,
+			  struct jbfs_tree_path *path, int *depth)
+{
+	struct jbfs_tree_path *leaf;
+	int ret;
+
+	ret = jbfs_tree_find(inode, lblock, path, depth);
+	if (ret)
+		return ret;
+
+	leaf = &path[*depth];
+	if (leaf->p_index >= 0 &&
+	    jbfs_tree_key(leaf->p_bh, leaf->p_index) >= lblock)
+		return 1;
+
+	ret = jbfs_tree_advance(inode, path, *depth);
+	if (ret < 0)
+		jbfs_tree_release(path, *depth);
+	return ret;
+}
+
+/*
+ * The first entry of the node at level changed to key; update the parents
+ * that point to it.
+ */
+static void jbfs_tree_fix_keys(struct inode *inode,
+			       struct jbfs_tree_path *path, int level,
+			       uint64_t key)
+{
+	for (; level > 0; --level) {
+		struct jbfs_tree_index *ti =
+		    jbfs_tree_entry(path[level - 1].p_bh,
+				    path[level - 1].p_index);
+
+		ti->ti_lblock = cpu_to_le64(key);
+		mark_buffer_dirty_inode(path[level - 1].p_bh, inode);
+		if (path[level - 1].p_index)
+			break;
+	}
+}
+
+static struct buffer_head *jbfs_tree_new_node(struct inode *inode, int *err)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	uint64_t block;
+	int n = 1;
+
+	block = jbfs_alloc_run(inode, &n, err);
+	if (!block)
+		return NULL;
+
+	bh = sb_getblk(sb, block);
+	if (!bh) {
+		jbfs_dealloc_blocks(sb, block, 1, err);
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	JBFS_TREE_HEADER(bh)->th_magic = cpu_to_le32(JBFS_TREE_MAGIC);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+
+	JBFS_I(inode)->i_tree_blocks += 1;
+	return bh;
+}
+
+static void jbfs_tree_free_node(struct inode *inode, struct buffer_head *bh)
+{
+	uint64_t block = bh->b_blocknr;
+	int err;
+
+	bforget(bh);
+	jbfs_dealloc_blocks(inode->i_sb, block, 1, &err);
+	JBFS_I(inode)->i_tree_blocks -= 1;
+}
+
+static void jbfs_tree_put(struct inode *inode, struct buffer_head *bh, int pos,
+			  const void *entry)
+{
+	size_t size = jbfs_tree_esize(bh);
+	int n = jbfs_tree_entries(bh);
+
+	memmove(jbfs_tree_entry(bh, pos + 1), jbfs_tree_entry(bh, pos),
+		(n - pos) * size);
+	memcpy(jbfs_tree_entry(bh, pos), entry, size);
+	JBFS_TREE_HEADER(bh)->th_entries = cpu_to_le16(n + 1);
+	mark_buffer_dirty_inode(bh, inode);
+}
+
+/*
+ * Move the contents of the root into a new child, so the root can be split
+ * like any other node without changing i_cont.
+ */
+static void jbfs_tree_grow(struct inode *inode, struct jbfs_tree_path *path,
+			   int *depth, struct buffer_head *nbh)
+{
+	struct buffer_head *root = path[0].p_bh;
+	struct jbfs_tree_header *th = JBFS_TREE_HEADER(root);
+	struct jbfs_tree_index *ti;
+
+	memcpy(nbh->b_data, root->b_data, root->b_size);
+	mark_buffer_dirty_inode(nbh, inode);
+
+	memmove(path + 1, path, (*depth + 1) * sizeof(*path));
+	path[1].p_bh = nbh;
+	path[0].p_index = 0;
+	*depth += 1;
+
+	th->th_depth = cpu_to_le16(*depth);
+	th->th_entries = cpu_to_le16(1);
+	ti = jbfs_tree_entry(root, 0);
+	ti->ti_lblock = cpu_to_le64(jbfs_tree_key(nbh, 0));
+	ti->ti_block = cpu_to_le64(nbh->b_blocknr);
+	mark_buffer_dirty_inode(root, inode);
+}
+
+/*
+ * Insert an entry at position pos of the node at level, splitting full nodes
+ * on the way up. All blocks that may be needed are allocated up front, so the
+ * tree is left untouched if this fails. The path is stale afterwards.
+ */
+static int jbfs_tree_insert(struct inode *inode, struct jbfs_tree_path *path,
+			    int *depth, int level, int pos, const void *entry)
+{
+	struct buffer_head *new_bh[JBFS_TREE_MAX_DEPTH];
+	struct jbfs_tree_index ti;
+	const void *item = entry;
+	int needed = 0;
+	int l, i, err;
+
+	for (l = level; l >= 0 && jbfs_tree_full(path[l].p_bh); --l)
+		needed += 1;
+
+	if (l < 0) {
+		if (*depth + 1 >= JBFS_TREE_MAX_DEPTH)
+			return -EFBIG;
+		needed += 1;
+	}
+
+	for (i = 0; i < needed; ++i) {
+		new_bh[i] = jbfs_tree_new_node(inode, &err);
+		if (!new_bh[i]) {
+			while (i--)
+				jbfs_tree_free_node(inode, new_bh[i]);
+			return err;
+		}
+	}
+
+	if (l < 0) {
+		jbfs_tree_grow(inode, path, depth, new_bh[--needed]);
+		level += 1;
+	}
+
+	while (jbfs_tree_full(path[level].p_bh)) {
+		struct buffer_head *bh = path[level].p_bh;
+		struct buffer_head *nbh = new_bh[--needed];
+		struct jbfs_tree_header *th = JBFS_TREE_HEADER(bh);
+		struct jbfs_tree_header *nth = JBFS_TREE_HEADER(nbh);
+		int n = jbfs_tree_entries(bh);
+		int split;
+
+		/*
+		 * Appends start a new node instead of splitting the old one
+		 * in half, so files written sequentially get full nodes.
+		 */
+		split = pos == n ? n : n / 2;
+
+		nth->th_depth = th->th_depth;
+		nth->th_entries = cpu_to_le16(n - split);
+		memcpy(jbfs_tree_entry(nbh, 0), jbfs_tree_entry(bh, split),
+		       (n - split) * jbfs_tree_esize(bh));
+		th->th_entries = cpu_to_le16(split);
+		mark_buffer_dirty_inode(bh, inode);
+
+		if (pos > split || split == n) {
+			jbfs_tree_put(inode, nbh, pos - split, item);
+		} else {
+			jbfs_tree_put(inode, bh, pos, item);
+			if (!pos)
+				jbfs_tree_fix_keys(inode, path, level,
+						   jbfs_tree_key(bh, 0));
+		}
+
+		ti.ti_lblock = cpu_to_le64(jbfs_tree_key(nbh, 0));
+		ti.ti_block = cpu_to_le64(nbh->b_blocknr);
+		brelse(nbh);
+
+		item = &ti;
+		level -= 1;
+		pos = path[level].p_index + 1;
+	}
+
+	jbfs_tree_put(inode, path[level].p_bh, pos, item);
+	if (!pos)
+		jbfs_tree_fix_keys(inode, path, level,
+				   jbfs_tree_key(path[level].p_bh, 0));
+	return 0;
+}
+
+/*
+ * Remove the entry the path points to at level, freeing nodes that become
+ * empty. An empty root is turned back into an empty leaf. The path is stale
+ * afterwards.
+ */
+static void jbfs_tree_delete(struct inode *inode, struct jbfs_tree_path *path,
+			     int depth, int level)
+{
+	struct buffer_head *bh = path[level].p_bh;
+	struct jbfs_tree_header *th = JBFS_TREE_HEADER(bh);
+	int pos = path[level].p_index;
+	int n = jbfs_tree_entries(bh) - 1;
+
+	if (!n && level) {
+		jbfs_tree_free_node(inode, bh);
+		path[level].p_bh = NULL;
+		jbfs_tree_delete(inode, path, depth, level - 1);
+		return;
+	}
+
+	memmove(jbfs_tree_entry(bh, pos), jbfs_tree_entry(bh, pos + 1),
+		(n - pos) * jbfs_tree_esize(bh));
+	th->th_entries = cpu_to_le16(n);
+	if (!n)
+		th->th_depth = 0;
+	else if (!pos)
+		jbfs_tree_fix_keys(inode, path, level, jbfs_tree_key(bh, 0));
+	mark_buffer_dirty_inode(bh, inode);
+}
+
+/*
+ * Overwrite the extent the path points to.
+ */
+static void jbfs_tree_set(struct inode *inode, struct jbfs_tree_path *path,
+			  int depth, const struct jbfs_extent *ext)
+{
+	struct jbfs_tree_path *leaf = &path[depth];
+	struct jbfs_extent old;
+
+	jbfs_tree_get(leaf->p_bh, leaf->p_index, &old);
+	jbfs_tree_encode(ext, jbfs_tree_entry(leaf->p_bh, leaf->p_index));
+	mark_buffer_dirty_inode(leaf->p_bh, inode);
+	JBFS_I(inode)->i_tree_blocks += ext->e_len - old.e_len;
+
+	if (!leaf->p_index && ext->e_lblock != old.e_lblock)
+		jbfs_tree_fix_keys(inode, path, depth, ext->e_lblock);
+}
+
+static int jbfs_tree_add(struct inode *inode, struct jbfs_tree_path *path,
+			 int *depth, const struct jbfs_extent *ext)
+{
+	struct jbfs_tree_leaf tl;
+	int ret;
+
+	jbfs_tree_encode(ext, &tl);
+	ret = jbfs_tree_insert(inode, path, depth, *depth,
+			       path[*depth].p_index + 1, &tl);
+	if (!ret)
+		JBFS_I(inode)->i_tree_blocks += ext->e_len;
+	return ret;
+}
+
+/*
+ * Whether next directly continues prev, both logically and on disk.
+ */
+static int jbfs_tree_contiguous(const struct jbfs_extent *prev,
+				const struct jbfs_extent *next)
+{
+	return prev->e_lblock + prev->e_len == next->e_lblock &&
+	    prev->e_flags == next->e_flags &&
+	    prev->e_start + prev->e_len == next->e_start;
+}
+
+static int jbfs_tree_lookup(struct inode *inode, uint64_t lblock,
+			    struct jbfs_extent *ext)
+{
+	struct jbfs_tree_path path[JBFS_TREE_MAX_DEPTH];
+	struct jbfs_tree_path *leaf;
+	uint64_t prev_end = 0;
+	int depth, ret;
+
+	ret = jbfs_tree_find(inode, lblock, path, &depth);
+	if (ret)
+		return ret;
+
+	leaf = &path[depth];
+	if (leaf->p_index >= 0) {
+		jbfs_tree_get(leaf->p_bh, leaf->p_index, ext);
+		prev_end = ext->e_lblock + ext->e_len;
+		if (lblock < prev_end)
+			goto out;
+	}
+
+	/*
+	 * Not mapped: either a hole up to the next extent, or past the end.
+	 */
+	ret = jbfs_tree_advance(inode, path, depth);
+	if (ret < 0)
+		goto out;
+
+	if (ret) {
+		ext->e_len = jbfs_tree_key(leaf->p_bh, leaf->p_index) -
+		    prev_end;
+		ext->e_flags = JBFS_EXTENT_HOLE;
+		ret = 0;
+	} else {
+		ext->e_len = 0;
+		ext->e_flags = 0;
+		ret = -ENOENT;
+	}
+	ext->e_lblock = prev_end;
+	ext->e_start = 0;
+
+ out:
+	jbfs_tree_release(path, depth);
+	return ret;
+}
+
+/*
+ * Split the extent containing lblock, if any, so that an extent starts at
+ * lblock.
+ */
+static int jbfs_tree_split(struct inode *inode, uint64_t lblock)
+{
+	struct jbfs_tree_path path[JBFS_TREE_MAX_DEPTH];
+	struct jbfs_tree_path *leaf;
+	struct jbfs_extent head, tail;
+	int depth, ret;
+
+	ret = jbfs_tree_find(inode, lblock, path, &depth);
+	if (ret)
+		return ret;
+
+	leaf = &path[depth];
+	if (leaf->p_index < 0)
+		goto out;
+
+	jbfs_tree_get(leaf->p_bh, leaf->p_index, &head);
+	if (head.e_lblock == lblock || head.e_lblock + head.e_len <= lblock)
+		goto out;
+
+	tail = head;
+	tail.e_lblock = lblock;
+	tail.e_start += lblock - head.e_lblock;
+	tail.e_len -= lblock - head.e_lblock;
+	head.e_len -= tail.e_len;
+
+	/*
+	 * A failed insert leaves the path intact, so the head can be put back.
+	 */
+	jbfs_tree_set(inode, path, depth, &head);
+	ret = jbfs_tree_add(inode, path, &depth, &tail);
+	if (ret) {
+		head.e_len += tail.e_len;
+		jbfs_tree_set(inode, path, depth, &head);
+	}
+
+ out:
+	jbfs_tree_release(path, depth);
+	return ret;
+}
+
+/*
+ * Merge the extents on either side of lblock if they are contiguous.
+ */
+static int jbfs_tree_merge(struct inode *inode, uint64_t lblock)
+{
+	struct jbfs_tree_path path[JBFS_TREE_MAX_DEPTH];
+	struct jbfs_extent prev, next;
+	int depth, ret;
+
+	if (!lblock)
+		return 0;
+
+	ret = jbfs_tree_find(inode, lblock - 1, path, &depth);
+	if (ret)
+		return ret;
+
+	if (path[depth].p_index < 0)
+		goto out;
+
+	jbfs_tree_get(path[depth].p_bh, path[depth].p_index, &prev);
+	if (prev.e_lblock + prev.e_len != lblock)
+		goto out;
+
+	ret = jbfs_tree_advance(inode, path, depth);
+	if (ret <= 0)
+		goto out;
+
+	ret = 0;
+	jbfs_tree_get(path[depth].p_bh, path[depth].p_index, &next);
+	if (!jbfs_tree_contiguous(&prev, &next))
+		goto out;
+
+	jbfs_tree_delete(inode, path, depth, depth);
+	JBFS_I(inode)->i_tree_blocks -= next.e_len;
+	jbfs_tree_release(path, depth);
+
+	ret = jbfs_tree_find(inode, prev.e_lblock, path, &depth);
+	if (ret)
+		return ret;
+	prev.e_len += next.e_len;
+	jbfs_tree_set(inode, path, depth, &prev);
+
+ out:
+	jbfs_tree_release(path, depth);
+	return ret;
+}
+
+/*
+ * Move every extent starting at or after lblock down by len blocks.
+ */
+static int jbfs_tree_shift(struct inode *inode, uint64_t lblock, uint64_t len)
+{
+	struct jbfs_tree_path path[JBFS_TREE_MAX_DEPTH];
+	struct jbfs_extent ext;
+	int depth, ret;
+
+	ret = jbfs_tree_seek(inode, lblock, path, &depth);
+	if (ret < 0)
+		return ret;
+
+	while (ret > 0) {
+		jbfs_tree_get(path[depth].p_bh, path[depth].p_index, &ext);
+		ext.e_lblock -= len;
+		jbfs_tree_set(inode, path, depth, &ext);
+		ret = jbfs_tree_advance(inode, path, depth);
+	}
+
+	jbfs_tree_release(path, depth);
+	return min(ret, 0);
+}
+
+/*
+ * Move the inline extent list into a new tree.
+ */
+static int jbfs_tree_convert(struct inode *inode)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct buffer_head *bh;
+	struct jbfs_extent ext;
+	uint64_t pos = 0;
+	int i, n = 0;
+	int err;
+
+	ji->i_tree_blocks = 0;
+	bh = jbfs_tree_new_node(inode, &err);
+	if (!bh)
+		return err;
+
+	for (i = 0; i < 12 && ji->i_extents[i][0]; ++i) {
+		jbfs_decode_extent(ji->i_extents[i], pos, &ext);
+		pos += ext.e_len;
+		if (ext.e_flags & JBFS_EXTENT_HOLE)
+			continue;
+		jbfs_tree_encode(&ext, jbfs_tree_entry(bh, n++));
+		ji->i_tree_blocks += ext.e_len;
+	}
+
+	JBFS_TREE_HEADER(bh)->th_entries = cpu_to_le16(n);
+	mark_buffer_dirty_inode(bh, inode);
+
+	ji->i_cont = bh->b_blocknr;
+	memset(ji->i_extents, 0, sizeof(ji->i_extents));
+	jbfs_drop_extent_cache(inode);
+	brelse(bh);
+
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Free the root once the tree is empty, going back to the inline list.
+ */
+static int jbfs_tree_drop_empty(struct inode *inode)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct buffer_head *bh;
+	int err;
+
+	bh = jbfs_tree_read(inode, ji->i_cont, -1, &err);
+	if (!bh)
+		return err;
+
+	if (jbfs_tree_entries(bh)) {
+		brelse(bh);
+		return 0;
+	}
+
+	jbfs_tree_free_node(inode, bh);
+	ji->i_cont = 0;
+	ji->i_tree_blocks = 0;
+	return 0;
+}
+
+/*
+ * Same as jbfs_inline_edit, for inodes with an extent tree. The range is
+ * first split off from the extents around it, then every extent in it is
+ * removed, except that the first one is reused for repl if there is one.
+ */
+static int jbfs_tree_edit(struct inode *inode, uint64_t lblock, uint64_t len,
+			  const struct jbfs_extent *repl, int release)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_tree_path path[JBFS_TREE_MAX_DEPTH];
+	struct jbfs_extent ext;
+	uint64_t end = lblock + len;
+	uint64_t pos = lblock;
+	int collapse = !repl;
+	int placed = 0;
+	int depth, ret, err;
+
+	/*
+	 * Holes are not stored in the tree.
+	 */
+	if (repl && (repl->e_flags & JBFS_EXTENT_HOLE))
+		repl = NULL;
+
+	ret = jbfs_tree_split(inode, end);
+	if (!ret)
+		ret = jbfs_tree_split(inode, lblock);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		ret = jbfs_tree_seek(inode, pos, path, &depth);
+		if (ret < 0)
+			return ret;
+
+		if (ret)
+			jbfs_tree_get(path[depth].p_bh, path[depth].p_index,
+				      &ext);
+		if (!ret || ext.e_lblock >= end)
+			break;
+
+		if (release)
+			jbfs_dealloc_blocks(inode->i_sb, ext.e_start, ext.e_len,
+					    &err);
+
+		if (repl && !placed) {
+			jbfs_tree_set(inode, path, depth, repl);
+			placed = 1;
+			pos = lblock + 1;
+		} else {
+			jbfs_tree_delete(inode, path, depth, depth);
+			ji->i_tree_blocks -= ext.e_len;
+		}
+		jbfs_tree_release(path, depth);
+	}
+	jbfs_tree_release(path, depth);
+	ret = 0;
+
+	/*
+	 * Nothing was mapped in the range. Appends usually continue the
+	 * previous extent, which doesn't need a new entry.
+	 */
+	if (repl && !placed) {
+		ret = jbfs_tree_find(inode, lblock, path, &depth);
+		if (ret)
+			return ret;
+
+		if (path[depth].p_index >= 0)
+			jbfs_tree_get(path[depth].p_bh, path[depth].p_index,
+				      &ext);
+		if (path[depth].p_index >= 0 &&
+		    jbfs_tree_contiguous(&ext, repl)) {
+			ext.e_len += repl->e_len;
+			jbfs_tree_set(inode, path, depth, &ext);
+		} else {
+			ret = jbfs_tree_add(inode, path, &depth, repl);
+		}
+
+		jbfs_tree_release(path, depth);
+		if (ret)
+			return ret;
+	}
+
+	if (repl) {
+		ret = jbfs_tree_merge(inode, end);
+		if (!ret)
+			ret = jbfs_tree_merge(inode, lblock);
+	} else if (collapse) {
+		ret = jbfs_tree_shift(inode, end, len);
+		if (!ret)
+			ret = jbfs_tree_merge(inode, lblock);
+	}
+
+	if (!ret)
+		ret = jbfs_tree_drop_empty(inode);
+
+	mark_inode_dirty(inode);
+	return ret;
+}
+
+/*
+ * Find the extent containing lblock. Unmapped ranges inside the file are
+ * returned as holes. If lblock lies past the last extent, -ENOENT is returned
+ * and ext->e_lblock is set to the end of the list.
+ */
+int jbfs_extent_lookup(struct inode *inode, uint64_t lblock,
+		       struct jbfs_extent *ext)
+{
+	if (JBFS_I(inode)->i_cont)
+		return jbfs_tree_lookup(inode, lblock, ext);
+
+	return jbfs_inline_lookup(inode, lblock, ext);
+}
+
+/*
+ * Get the number of blocks mapped by the extent list, including the blocks
+ * of the extent tree.
+ */
+uint64_t jbfs_extent_blocks(struct inode *inode)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	struct jbfs_extent_cache *ec;
+	struct jbfs_extent_cache tmp;
+
+	if (ji->i_cont)
+		return ji->i_tree_blocks;
+
+	ec = jbfs_get_extent_cache(inode);
+	if (!ec) {
+		ec = &tmp;
+		jbfs_fill_extent_cache(inode, ec);
+	}
+
+	return ec->ec_blocks;
+}
+
+/*
+ * Get the number of logical blocks covered by the extent list.
+ */
+int jbfs_extent_end(struct inode *inode, uint64_t *end)
+{
+	struct jbfs_extent ext;
+	int ret;
+
+	ret = jbfs_extent_lookup(inode, U64_MAX, &ext);
+	if (ret != -ENOENT)
+		return ret ? ret : -EIO;
+
+	*end = ext.e_lblock;
+	return 0;
+}
+
+/*
+ * Count the extents that have blocks, to see how fragmented a file is.
+ */
+int jbfs_extent_count(struct inode *inode, uint64_t *count)
+{
+	struct jbfs_extent ext;
+	uint64_t pos = 0;
+	int ret;
+
+	*count = 0;
+	while (!(ret = jbfs_extent_lookup(inode, pos, &ext))) {
+		if (!(ext.e_flags & JBFS_EXTENT_HOLE))
+			*count += 1;
+		pos = ext.e_lblock + ext.e_len;
+	}
+
+	return ret == -ENOENT ? 0 : ret;
+}
+
+/*
+ * Edit the extent list as described for jbfs_inline_edit, moving it into a
+ * tree first if the result would not fit in the inode.
+ */
+static int jbfs_extent_edit(struct inode *inode, uint64_t lblock,
+			    uint64_t len, const struct jbfs_extent *repl,
+			    int release)
+{
+	int ret;
+
+	/*
+	 * Writeback caches mappings for as long as this stays the same.
+	 */
+	WRITE_ONCE(JBFS_I(inode)->i_extent_seq,
+		   JBFS_I(inode)->i_extent_seq + 1);
+
+	if (!JBFS_I(inode)->i_cont) {
+		ret = jbfs_inline_edit(inode, lblock, len, repl, release);
+		if (ret != -EFBIG)
+			return ret;
+
+		ret = jbfs_tree_convert(inode);
+		if (ret)
+			return ret;
+	}
+
+	return jbfs_tree_edit(inode, lblock, len, repl, release);
+}
+
+/*
+ * Map [lblock, lblock + len) to the physical blocks starting at start, with
+ * the given flags. A range past the end of the list leaves a hole before it.
+ */
+int jbfs_extent_set(struct inode *inode, uint64_t lblock, uint64_t len,
+		    uint64_t start, uint64_t flags, int release)
+{
+	struct jbfs_extent ext = {
+		.e_lblock = lblock,
+		.e_start = flags & JBFS_EXTENT_HOLE ? 0 : start,
+		.e_len = len,
+		.e_flags = flags,
+	};
+
+	return jbfs_extent_edit(inode, lblock, len, &ext, release);
+}
+
+/*
+ * Free [lblock, lblock + len) and move everything after it down.
+ */
+int jbfs_extent_collapse(struct inode *inode, uint64_t lblock, uint64_t len)
+{
+	return jbfs_extent_edit(inode, lblock, len, NULL, 1);
+}
+
+/*
+ * Free everything from lblock on.
+ */
+int jbfs_extent_truncate(struct inode *inode, uint64_t lblock)
+{
+	uint64_t end;
+	int ret;
+
+	ret = jbfs_extent_end(inode, &end);
+	if (ret || lblock >= end)
+		return ret;
+
+	return jbfs_extent_edit(inode, lblock, end - lblock, NULL, 1);
+}
+
+/*
+ * Allocate blocks for a hole, as a written or unwritten extent depending on
+ * flags. On success, *block and *len are set to the run that was allocated,
+ * starting at lblock.
+ */
+int jbfs_fill_hole(struct inode *inode, uint64_t lblock, uint64_t *len,
+		   sector_t *block, uint64_t flags)
+{
+	int n = min_t(uint64_t, *len, INT_MAX);
+	uint64_t start;
+	int ret, err;
+
+	start = jbfs_alloc_run(inode, &n, &ret);
+	if (!start)
+		return ret;
+
+	ret = jbfs_extent_set(inode, lblock, n, start, flags, 0);
+	if (ret) {
+		jbfs_dealloc_blocks(inode->i_sb, start, n, &err);
+		return ret;
+	}
+
+	*block = start;
+	*len = n;
+	return 0;
+}
+
+/*
+ * Move [lblock, lblock + *len) of a written extent to a new run of blocks,
+ * dropping the references to the old ones, which are shared with other files.
+ * Nothing is copied: the caller writes the data out from the page cache.
+ */
+int jbfs_unshare_blocks(struct inode *inode, uint64_t lblock, uint64_t *len,
+			sector_t *block)
+{
+	int n = min_t(uint64_t, *len, INT_MAX);
+	uint64_t start;
+	int ret, err;
+
+	start = jbfs_alloc_run(inode, &n, &ret);
+	if (!start)
+		return ret;
+
+	ret = jbfs_extent_set(inode, lblock, n, start, 0, 1);
+	if (ret) {
+		jbfs_dealloc_blocks(inode->i_sb, start, n, &err);
+		return ret;
+	}
+
+	*block = start;
+	*len = n;
+	return 0;
+}
+
+/*
+ * Convert [lblock, lblock + len) of the unwritten extent ext to written. If
+ * the extent tree can't grow any further, the rest of it is zeroed on disk and
+ * the whole extent is converted instead.
+ */
+int jbfs_convert_unwritten(struct inode *inode, const struct jbfs_extent *ext,
+			   uint64_t lblock, uint64_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	uint64_t start = ext->e_start + lblock - ext->e_lblock;
+	uint64_t tail = ext->e_lblock + ext->e_len - lblock - len;
+	int ret;
+
+	ret = jbfs_extent_set(inode, lblock, len, start, 0, 0);
+	if (ret != -EFBIG)
+		return ret;
+
+	if (lblock > ext->e_lblock) {
+		ret = sb_issue_zeroout(sb, ext->e_start, lblock - ext->e_lblock,
+				       GFP_NOFS);
+		if (ret)
+			return ret;
+	}
+
+	if (tail) {
+		ret = sb_issue_zeroout(sb, start + len, tail, GFP_NOFS);
+		if (ret)
+			return ret;
+	}
+
+	return jbfs_extent_set(inode, ext->e_lblock, ext->e_len, ext->e_start,
+			       0, 0);
+}
+
+/*
+ * Convert every unwritten extent in [lblock, lblock + len) to written, once
+ * direct I/O has put the data in place.
+ */
+int jbfs_convert_range(struct inode *inode, uint64_t lblock, uint64_t len)
+{
+	struct jbfs_extent ext;
+	uint64_t n;
+	int ret = 0;
+
+	while (len) {
+		ret = jbfs_extent_lookup(inode, lblock, &ext);
+		if (ret)
+			break;
+
+		n = min(ext.e_lblock + ext.e_len - lblock, len);
+		if (ext.e_flags & JBFS_EXTENT_UNWRITTEN) {
+			ret = jbfs_convert_unwritten(inode, &ext, lblock, n);
+			if (ret)
+				break;
+		}
+
+		lblock += n;
+		len -= n;
+	}
+
+	return ret;
+}
+
+/*
+ * Allocate unwritten extents for every hole in [lblock, lblock + len) and for
+ * any part of it past the end of the extent list. Runs are allocated as large
+ * as the allocator can make them.
+ */
+int jbfs_prealloc_blocks(struct inode *inode, uint64_t lblock, uint64_t len)
+{
+	uint64_t end = lblock + len;
+	struct jbfs_extent ext;
+	sector_t start;
+	int ret = 0;
+	int n, err;
+
+	while (lblock < end) {
+		ret = jbfs_extent_lookup(inode, lblock, &ext);
+		if (!ret) {
+			uint64_t count = min(ext.e_lblock + ext.e_len, end) -
+			    lblock;
+
+			if (ext.e_flags & JBFS_EXTENT_HOLE) {
+				ret = jbfs_fill_hole(inode, lblock, &count,
+						     &start,
+						     JBFS_EXTENT_UNWRITTEN);
+				if (ret)
+					break;
+			}
+			lblock += count;
+			continue;
+		}
+		if (ret != -ENOENT)
+			break;
+
+		n = min_t(uint64_t, end - lblock, INT_MAX);
+
+		if (lblock == ext.e_lblock) {
+			jbfs_new_blocks(inode, &n, JBFS_EXTENT_UNWRITTEN, &ret);
+			if (ret)
+				break;
+		} else {
+			start = jbfs_alloc_run(inode, &n, &ret);
+			if (!start)
+				break;
+
+			ret = jbfs_extent_set(inode, lblock, n, start,
+					      JBFS_EXTENT_UNWRITTEN, 0);
+			if (ret) {
+				jbfs_dealloc_blocks(inode->i_sb, start, n, &err);
+				break;
+			}
+		}
+		lblock += n;
+	}
+
+	return ret;
+}
+
+/*
+ * Make the written blocks in [lblock, lblock + len) read as zeroes, keeping
+ * them allocated. Written extents are converted to unwritten, or zeroed on
+ * disk if the extent tree can't grow any further.
+ */
+int jbfs_zero_blocks(struct inode *inode, uint64_t lblock, uint64_t len)
+{
+	uint64_t pos = lblock, end = lblock + len;
+	struct jbfs_extent ext;
+	int ret = 0;
+
+	/*
+	 * Shared blocks can't be converted in place, as a later write to
+	 * them would show up in the other files. Free them instead; the
+	 * caller preallocates the holes that are left.
+	 */
+	if (JBFS_I(inode)->i_flags & JBFS_INODE_SHARED)
+		return jbfs_punch_blocks(inode, lblock, len);
+
+	while (pos < end && !(ret = jbfs_extent_lookup(inode, pos, &ext))) {
+		uint64_t n = min(ext.e_lblock + ext.e_len, end) - pos;
+		uint64_t start = ext.e_start + pos - ext.e_lblock;
+
+		if (!ext.e_flags) {
+			ret = jbfs_extent_set(inode, pos, n, start,
+					      JBFS_EXTENT_UNWRITTEN, 0);
+			if (ret == -EFBIG)
+				ret = sb_issue_zeroout(inode->i_sb, start, n,
+						       GFP_NOFS);
+			if (ret)
+				return ret;
+		}
+		pos += n;
+	}
+
+	return ret == -ENOENT ? 0 : ret;
+}
+
+/*
+ * Free the blocks in [lblock, lblock + len), leaving a hole. If the extent
+ * tree can't grow any further, the blocks are zeroed on disk instead, unless
+ * they may be shared with other files.
+ */
+int jbfs_punch_blocks(struct inode *inode, uint64_t lblock, uint64_t len)
+{
+	uint64_t pos = lblock, end;
+	struct jbfs_extent ext;
+	int ret;
+
+	ret = jbfs_extent_end(inode, &end);
+	if (ret)
+		return ret;
+
+	end = min(lblock + len, end);
+	if (lblock >= end)
+		return 0;
+
+	ret = jbfs_extent_set(inode, lblock, end - lblock, 0,
+			      JBFS_EXTENT_HOLE, 1);
+	if (ret != -EFBIG || (JBFS_I(inode)->i_flags & JBFS_INODE_SHARED))
+		return ret;
+
+	while (pos < end && !(ret = jbfs_extent_lookup(inode, pos, &ext))) {
+		uint64_t n = min(ext.e_lblock + ext.e_len, end) - pos;
+
+		if (!ext.e_flags) {
+			ret = sb_issue_zeroout(inode->i_sb,
+					       ext.e_start + pos - ext.e_lblock,
+					       n, GFP_NOFS);
+			if (ret)
+				return ret;
+		}
+		pos += n;
+	}
+
+	return ret == -ENOENT ? 0 : ret;
+}
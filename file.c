@@ -2,6 +2,7 @@
 // Copyright (C) 1991, 1992 Linus Torvalds
 // Copyright (C) 2020, 2021 Julian Blaauboer
 
+#include <linux/falloc.h>
 #include "jbfs.h"
 
 static int jbfs_setattr(struct dentry *dentry, struct iattr *attr)
@@ -18,6 +19,7 @@ static int jbfs_setattr(struct dentry *dentry, struct iattr *attr)
 		if (err)
 			return err;
 
+		inode_dio_wait(inode);
 		truncate_setsize(inode, attr->ia_size);
 		jbfs_truncate(inode);
 	}
@@ -27,13 +29,612 @@ static int jbfs_setattr(struct dentry *dentry, struct iattr *attr)
 	return 0;
 }
 
+/*
+ * Give back the preallocation window once the last writer is gone.
+ */
+static int jbfs_release_file(struct inode *inode, struct file *file)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+
+	if ((file->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) == 1) {
+		mutex_lock(&ji->i_extent_lock);
+		jbfs_discard_window(inode);
+		ji->i_window_size = 0;
+		mutex_unlock(&ji->i_extent_lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Zero [from, from + len) in the page cache, where the range lies within a
+ * single block. Blocks that aren't written read as zeroes already.
+ */
+static int jbfs_zero_partial(struct inode *inode, loff_t from, loff_t len)
+{
+	if (!len || from >= i_size_read(inode))
+		return 0;
+
+	return iomap_zero_range(inode, from, len, NULL, &jbfs_iomap_ops);
+}
+
+/*
+ * Zero the partial blocks at either end of [offset, offset + len) and drop
+ * the whole blocks in between from the page cache. Returns the range of whole
+ * blocks through *first and *last.
+ */
+static int jbfs_prepare_range(struct inode *inode, loff_t offset, loff_t len,
+			      loff_t *first, loff_t *last)
+{
+	loff_t end = offset + len;
+	int err;
+
+	*first = round_up(offset, i_blocksize(inode));
+	*last = round_down(end, i_blocksize(inode));
+
+	if (*first > *last) {
+		*first = *last = offset;
+		return jbfs_zero_partial(inode, offset, len);
+	}
+
+	err = jbfs_zero_partial(inode, offset, *first - offset);
+	if (!err)
+		err = jbfs_zero_partial(inode, *last, end - *last);
+	if (!err && *first < *last)
+		truncate_pagecache_range(inode, *first, *last - 1);
+	return err;
+}
+
+static long jbfs_collapse_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	unsigned int blkbits = inode->i_blkbits;
+	int ret;
+
+	if ((offset | len) & (i_blocksize(inode) - 1))
+		return -EINVAL;
+
+	if (offset + len >= i_size_read(inode))
+		return -EINVAL;
+
+	truncate_pagecache(inode, offset);
+
+	mutex_lock(&ji->i_extent_lock);
+	jbfs_discard_window(inode);
+	ret = jbfs_extent_collapse(inode, offset >> blkbits, len >> blkbits);
+	mutex_unlock(&ji->i_extent_lock);
+
+	if (!ret)
+		i_size_write(inode, i_size_read(inode) - len);
+	return ret;
+}
+
+/*
+ * Preallocated blocks are unwritten extents: they are allocated on disk, but
+ * read as zeroes until they are written to. Punching a hole leaves a hole
+ * extent that has no blocks at all. Splitting extents moves the extent list
+ * into a tree once it no longer fits in the inode; only if that tree can't
+ * grow any further are punched and zeroed ranges zeroed on disk instead.
+ */
+static long jbfs_fallocate(struct file *file, int mode, loff_t offset,
+			   loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t end = offset + len;
+	loff_t first, last;
+	long ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE | FALLOC_FL_COLLAPSE_RANGE))
+		return -EOPNOTSUPP;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	inode_dio_wait(inode);
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto out;
+	}
+
+	/*
+	 * Write back dirty data first, which also allocates any delayed
+	 * blocks, so the extent list is complete.
+	 */
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset, LLONG_MAX);
+	if (ret)
+		goto out;
+
+	if (mode & FALLOC_FL_COLLAPSE_RANGE) {
+		ret = jbfs_collapse_range(inode, offset, len);
+		goto out_time;
+	}
+
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		ret = jbfs_prepare_range(inode, offset, len, &first, &last);
+		if (ret)
+			goto out;
+	}
+
+	mutex_lock(&ji->i_extent_lock);
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		jbfs_discard_window(inode);
+		ret = jbfs_punch_blocks(inode, first >> blkbits,
+					(last - first) >> blkbits);
+	} else {
+		if (mode & FALLOC_FL_ZERO_RANGE)
+			ret = jbfs_zero_blocks(inode, first >> blkbits,
+					       (last - first) >> blkbits);
+		if (!ret)
+			ret = jbfs_prealloc_blocks(inode, offset >> blkbits,
+					(round_up(end, i_blocksize(inode)) >>
+					 blkbits) - (offset >> blkbits));
+	}
+
+	mutex_unlock(&ji->i_extent_lock);
+
+	if (ret)
+		goto out;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+
+	if (!(mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) {
+		inode->i_ctime = current_time(inode);
+		mark_inode_dirty(inode);
+		goto out;
+	}
+ out_time:
+	if (!ret) {
+		inode->i_mtime = inode->i_ctime = current_time(inode);
+		mark_inode_dirty(inode);
+	}
+ out:
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+ * Make [to, to + len) of dst share the blocks of [from, from + len) of src.
+ * Holes and unwritten extents of src become holes in dst, as both read as
+ * zeroes; unwritten blocks are never shared, so writing to them never has to
+ * copy anything. The blocks are referenced with the extent lock of src held,
+ * so they can't be freed in between.
+ *
+ * Blocks that already have the maximum number of references can't be shared
+ * any further. Cloning fails on them with -EMLINK, but deduplication just
+ * leaves dst its own copy of the same data.
+ */
+static int jbfs_clone_blocks(struct inode *src, uint64_t from,
+			     struct inode *dst, uint64_t to, uint64_t len,
+			     int dedup)
+{
+	struct jbfs_inode_info *si = JBFS_I(src);
+	struct jbfs_inode_info *di = JBFS_I(dst);
+	struct super_block *sb = src->i_sb;
+	struct jbfs_extent ext;
+	uint64_t start, flags, n;
+	int ret = 0;
+	int err;
+
+	while (len) {
+		mutex_lock(&si->i_extent_lock);
+
+		ret = jbfs_extent_lookup(src, from, &ext);
+		if (!ret) {
+			n = min(ext.e_lblock + ext.e_len - from, len);
+			start = ext.e_start + from - ext.e_lblock;
+			flags = ext.e_flags ? JBFS_EXTENT_HOLE : 0;
+		} else if (ret == -ENOENT) {
+			n = len;
+			start = 0;
+			flags = JBFS_EXTENT_HOLE;
+			ret = 0;
+		} else {
+			mutex_unlock(&si->i_extent_lock);
+			break;
+		}
+
+		n = min_t(uint64_t, n, INT_MAX);
+		if (!flags) {
+			n = jbfs_ref_blocks(sb, start, n, &ret);
+
+			/*
+			 * Writeback of src must not reuse a mapping that
+			 * still takes these blocks to be its own.
+			 */
+			WRITE_ONCE(si->i_extent_seq, si->i_extent_seq + 1);
+		}
+
+		mutex_unlock(&si->i_extent_lock);
+
+		if (ret)
+			break;
+
+		if (!n) {
+			if (!dedup) {
+				ret = -EMLINK;
+				break;
+			}
+			from += 1;
+			to += 1;
+			len -= 1;
+			continue;
+		}
+
+		mutex_lock(&di->i_extent_lock);
+		if (flags)
+			ret = jbfs_punch_blocks(dst, to, n);
+		else
+			ret = jbfs_extent_set(dst, to, n, start, 0, 1);
+		mutex_unlock(&di->i_extent_lock);
+
+		if (ret) {
+			if (!flags)
+				jbfs_dealloc_blocks(sb, start, n, &err);
+			break;
+		}
+
+		from += n;
+		to += n;
+		len -= n;
+	}
+
+	return ret;
+}
+
+/*
+ * Reflinks share blocks between files by counting references to them in the
+ * refmap. Both files are marked JBFS_INODE_SHARED, so their writeback moves
+ * shared blocks to new ones before writing to them. copy_file_range within a
+ * filesystem ends up here as well, as the VFS tries to clone first.
+ *
+ * For deduplication, generic_remap_file_range_prep compares both ranges with
+ * their pages locked, and fails with -EBADE if they differ.
+ */
+static loff_t jbfs_remap_file_range(struct file *file_in, loff_t pos_in,
+				    struct file *file_out, loff_t pos_out,
+				    loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	unsigned int blkbits = src->i_blkbits;
+	loff_t blocksize = i_blocksize(src);
+	loff_t end;
+	int ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN |
+			    REMAP_FILE_ADVISORY))
+		return -EINVAL;
+
+	lock_two_nondirectories(src, dst);
+
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || len == 0)
+		goto out;
+
+	/*
+	 * A partial block at the end of src can only be cloned to the end of
+	 * dst, or the rest of the block would show up inside dst.
+	 */
+	end = pos_out + len;
+	if (!IS_ALIGNED(len, blocksize) && end < i_size_read(dst)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/*
+	 * Write back all of dst, which also allocates its delayed blocks, so
+	 * the extent list is complete.
+	 */
+	ret = filemap_write_and_wait(dst->i_mapping);
+	if (ret)
+		goto out;
+
+	JBFS_I(src)->i_flags |= JBFS_INODE_SHARED;
+	JBFS_I(dst)->i_flags |= JBFS_INODE_SHARED;
+	mark_inode_dirty(src);
+
+	truncate_inode_pages_range(dst->i_mapping, pos_out,
+				   round_up(end, blocksize) - 1);
+
+	mutex_lock(&JBFS_I(dst)->i_extent_lock);
+	jbfs_discard_window(dst);
+	mutex_unlock(&JBFS_I(dst)->i_extent_lock);
+
+	ret = jbfs_clone_blocks(src, pos_in >> blkbits, dst, pos_out >> blkbits,
+				round_up(len, blocksize) >> blkbits,
+				remap_flags & REMAP_FILE_DEDUP);
+
+	if (!ret && end > i_size_read(dst))
+		i_size_write(dst, end);
+	mark_inode_dirty(dst);
+ out:
+	unlock_two_nondirectories(src, dst);
+	return ret < 0 ? ret : len;
+}
+
+/*
+ * Holes and unwritten extents count as holes, except where the page cache
+ * has data for unwritten ones that hasn't been written back yet.
+ */
+static loff_t jbfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	switch (whence) {
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &jbfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &jbfs_iomap_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+static ssize_t jbfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+
+	ret = iomap_dio_rw(iocb, to, &jbfs_iomap_ops, NULL,
+			   is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+/*
+ * Buffered writes to regular files go through iomap. A write that fails
+ * part way may have allocated or reserved blocks past the end of the file,
+ * which are given back the same way as after a failed write_begin.
+ */
+static ssize_t jbfs_buffered_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end = iocb->ki_pos + iov_iter_count(from);
+	ssize_t ret;
+
+	ret = iomap_file_buffered_write(iocb, from, &jbfs_iomap_ops);
+	if (ret > 0)
+		iocb->ki_pos += ret;
+
+	if (iocb->ki_pos < end && end > i_size_read(inode)) {
+		printk(KERN_ERR "jbfs: failed to write to inode %lu\n",
+		       inode->i_ino);
+		truncate_pagecache(inode, i_size_read(inode));
+		jbfs_truncate(inode);
+	}
+
+	return ret;
+}
+
+/*
+ * Direct writes land in unwritten extents, which are only converted once the
+ * data is on disk. Writes past the end of the file always complete before
+ * jbfs_direct_write returns, so the size is updated under the inode lock.
+ */
+static int jbfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+				 unsigned flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t end = iocb->ki_pos + size;
+	int ret = 0;
+
+	if (error)
+		return error;
+
+	if (!size)
+		return 0;
+
+	if (flags & IOMAP_DIO_UNWRITTEN) {
+		mutex_lock(&ji->i_extent_lock);
+		ret = jbfs_convert_range(inode, iocb->ki_pos >> blkbits,
+					 ((end - 1) >> blkbits) -
+					 (iocb->ki_pos >> blkbits) + 1);
+		mutex_unlock(&ji->i_extent_lock);
+		if (ret) {
+			printk(KERN_WARNING
+			       "jbfs: converting unwritten blocks of inode %lu failed with code %d\n",
+			       inode->i_ino, ret);
+			return ret;
+		}
+	}
+
+	if (end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_dio_ops jbfs_dio_write_ops = {
+	.end_io = jbfs_dio_write_end_io,
+};
+
+/*
+ * Write directly what can be, and the rest through the page cache, setting
+ * *buffered to the number of bytes written that way.
+ */
+static ssize_t jbfs_direct_write(struct kiocb *iocb, struct iov_iter *from,
+				 ssize_t *buffered)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct address_space *mapping = inode->i_mapping;
+	unsigned int blockmask = i_blocksize(inode) - 1;
+	size_t count = iov_iter_count(from);
+	bool wait = is_sync_kiocb(iocb);
+	ssize_t ret;
+	loff_t pos;
+	int err;
+
+	if (iocb->ki_pos + count > i_size_read(inode))
+		wait = true;
+
+	/*
+	 * A write that covers only part of a block zeroes the rest of it if
+	 * the block is new, which would race with any other direct write to
+	 * the same block.
+	 */
+	if ((iocb->ki_pos | count) & blockmask) {
+		if (iocb->ki_flags & IOCB_NOWAIT)
+			return -EAGAIN;
+		inode_dio_wait(inode);
+		wait = true;
+	}
+
+	ret = iomap_dio_rw(iocb, from, &jbfs_iomap_ops, &jbfs_dio_write_ops,
+			   wait);
+	if (ret == -ENOTBLK)
+		ret = 0;
+	if (ret < 0 || !iov_iter_count(from))
+		return ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return ret ? ret : -EAGAIN;
+
+	/*
+	 * Whatever couldn't be written directly, because its blocks are shared
+	 * or its pages couldn't be dropped from the cache, goes through the
+	 * page cache. It is written back and dropped right away, so it doesn't
+	 * linger in the way of later direct I/O.
+	 */
+	pos = iocb->ki_pos;
+	*buffered = jbfs_buffered_write(iocb, from);
+	if (*buffered <= 0)
+		return ret ? ret : *buffered;
+
+	err = filemap_write_and_wait_range(mapping, pos, pos + *buffered - 1);
+	if (err)
+		return ret ? ret : err;
+
+	invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT,
+				 (pos + *buffered - 1) >> PAGE_SHIFT);
+	return ret + *buffered;
+}
+
+static ssize_t jbfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t buffered = 0;
+	ssize_t ret, err;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret)
+		goto out;
+
+	ret = file_update_time(iocb->ki_filp);
+	if (ret)
+		goto out;
+
+	if (iocb->ki_flags & IOCB_DIRECT)
+		ret = jbfs_direct_write(iocb, from, &buffered);
+	else
+		ret = buffered = jbfs_buffered_write(iocb, from);
+ out:
+	inode_unlock(inode);
+
+	/*
+	 * iomap already synced whatever was written directly.
+	 */
+	if (ret > 0 && buffered > 0) {
+		err = generic_write_sync(iocb, buffered);
+		if (err < 0)
+			ret = err;
+	}
+	return ret;
+}
+
+/*
+ * Writes through a shared mapping map their blocks when the page is first
+ * dirtied, like write() does: holes are filled, and with delayed allocation
+ * appends are only reserved. Running out of space then shows up at fault
+ * time, and writeback finds whole extents to write instead of allocating
+ * a page at a time.
+ */
+static vm_fault_t jbfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	ret = iomap_page_mkwrite(vmf, &jbfs_iomap_ops);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct jbfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = jbfs_page_mkwrite,
+};
+
+static int jbfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &jbfs_file_vm_ops;
+	return 0;
+}
+
 const struct file_operations jbfs_file_operations = {
-	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter,
-	.mmap = generic_file_mmap,
+	.llseek = jbfs_file_llseek,
+	.release = jbfs_release_file,
+	.read_iter = jbfs_file_read_iter,
+	.write_iter = jbfs_file_write_iter,
+	.mmap = jbfs_file_mmap,
 	.fsync = generic_file_fsync,
-	.splice_read = generic_file_splice_read
+	.splice_read = generic_file_splice_read,
+	.fallocate = jbfs_fallocate,
+	.remap_file_range = jbfs_remap_file_range,
+	.unlocked_ioctl = jbfs_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 const struct inode_operations jbfs_file_inode_operations = {
@@ -3,55 +3,373 @@
 
 #include <linux/buffer_head.h>
 #include <linux/bitops.h>
+#include <linux/blkdev.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
 #include "jbfs.h"
 
+/*
+ * After zeroing the inode table of a group, the lazyinit thread sleeps this
+ * many times as long as zeroing took, to leave the disk to everyone else.
+ */
+#define JBFS_LAZYINIT_MULT 10
+
+/*
+ * Inodes are placed Orlov-style. Directories created in the root directory
+ * start new subtrees, so they are spread over the groups: starting from a
+ * random group, the one with the fewest directories is picked among those
+ * with at least the average number of free inodes and blocks. Everything
+ * else stays near its parent, so a subtree can be traversed without seeking
+ * all over the disk. Only when the parent's group runs low do deeper
+ * directories move on to the next group that doesn't.
+ *
+ * The counts are read without locking the groups: they only steer the
+ * search, which jbfs_new_inode then does properly.
+ */
+static uint64_t jbfs_find_group_dir(struct super_block *sb, struct inode *dir)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t ngroups = sbi->s_num_groups;
+	uint64_t parent = dir->i_ino >> sbi->s_local_inode_bits;
+	uint64_t avg_inodes, avg_blocks, max_dirs, min_inodes, min_blocks;
+	uint64_t group, best, i;
+	uint32_t best_dirs = U32_MAX;
+
+	avg_inodes = percpu_counter_read_positive(&sbi->s_free_inodes);
+	avg_blocks = percpu_counter_read_positive(&sbi->s_free_blocks);
+	do_div(avg_inodes, ngroups);
+	do_div(avg_blocks, ngroups);
+
+	if (dir->i_ino == 1) {
+		group = prandom_u32_max(min_t(uint64_t, ngroups, U32_MAX));
+		best = group;
+
+		for (i = 0; i < ngroups; ++i) {
+			struct jbfs_group_info *gi = &sbi->s_group_info[group];
+			uint32_t dirs = READ_ONCE(gi->gi_used_dirs);
+
+			if (dirs < best_dirs &&
+			    READ_ONCE(gi->gi_free_inodes) >= avg_inodes &&
+			    READ_ONCE(gi->gi_free_blocks) >= avg_blocks) {
+				best = group;
+				best_dirs = dirs;
+			}
+
+			if (++group >= ngroups)
+				group = 0;
+		}
+
+		if (best_dirs != U32_MAX)
+			return best;
+	}
+
+	max_dirs = percpu_counter_read_positive(&sbi->s_dirs);
+	do_div(max_dirs, ngroups);
+	max_dirs += sbi->s_group_inodes / 16;
+	min_inodes = avg_inodes - min_t(uint64_t, avg_inodes,
+					sbi->s_group_inodes / 4);
+	min_blocks = avg_blocks - min_t(uint64_t, avg_blocks,
+					sbi->s_group_data_blocks / 4);
+
+	group = parent;
+	for (i = 0; i < ngroups; ++i) {
+		struct jbfs_group_info *gi = &sbi->s_group_info[group];
+
+		if (READ_ONCE(gi->gi_used_dirs) < max_dirs &&
+		    READ_ONCE(gi->gi_free_inodes) >= min_inodes &&
+		    READ_ONCE(gi->gi_free_blocks) >= min_blocks)
+			return group;
+
+		if (++group >= ngroups)
+			group = 0;
+	}
+
+	return parent;
+}
+
+/*
+ * Other inodes go in the group of their parent, or else in the first group
+ * after it that has both free inodes and free blocks.
+ */
+static uint64_t jbfs_find_group_other(struct super_block *sb,
+				      struct inode *dir)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t parent = dir->i_ino >> sbi->s_local_inode_bits;
+	uint64_t group = parent;
+	uint64_t i;
+
+	for (i = 0; i < sbi->s_num_groups; ++i) {
+		struct jbfs_group_info *gi = &sbi->s_group_info[group];
+
+		if (READ_ONCE(gi->gi_free_inodes) &&
+		    READ_ONCE(gi->gi_free_blocks))
+			return group;
+
+		if (++group >= sbi->s_num_groups)
+			group = 0;
+	}
+
+	return parent;
+}
+
+/*
+ * mkfs can leave the inode bitmap and inode table of a group unwritten by
+ * flagging it JBFS_GROUP_INODE_UNINIT; all inodes of such a group are free.
+ * Both are zeroed the first time an inode is allocated in the group, or by
+ * the lazyinit thread in the background, whichever comes first.
+ *
+ * Must be called with the group locked. The lock is dropped while the table
+ * is zeroed, so block allocation in the group can go on; inode allocation
+ * waits for JBFS_GROUP_INODE_ZEROING to clear instead.
+ */
+static int jbfs_init_inode_group(struct super_block *sb, uint64_t group)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_group_info *gi = &sbi->s_group_info[group];
+	uint64_t base = sbi->s_offset_group + group * sbi->s_group_size;
+	uint64_t bitmap_blocks, table_blocks, i;
+	struct buffer_head *bh;
+	int ret;
+
+	bitmap_blocks = DIV_ROUND_UP((uint64_t)sbi->s_group_inodes,
+				     sb->s_blocksize * 8);
+	table_blocks = DIV_ROUND_UP((uint64_t)sbi->s_group_inodes *
+				    JBFS_INODE_SIZE, sb->s_blocksize);
+
+	gi->gi_flags |= JBFS_GROUP_INODE_ZEROING;
+	JBFS_GROUP_UNLOCK(sbi, group);
+
+	ret = sb_issue_zeroout(sb, base + sbi->s_offset_inodes, table_blocks,
+			       GFP_NOFS);
+
+	for (i = 0; !ret && i < bitmap_blocks; ++i) {
+		bh = sb_getblk(sb, base + 1 + i);
+		if (!bh) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		lock_buffer(bh);
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+
+	JBFS_GROUP_LOCK(sbi, group);
+	gi->gi_flags &= ~JBFS_GROUP_INODE_ZEROING;
+	if (!ret) {
+		gi->gi_flags &= ~JBFS_GROUP_INODE_UNINIT;
+		gi->gi_inode_hint = 0;
+		jbfs_write_group_desc(sb, group);
+	}
+	wake_up_all(&sbi->s_inode_init_wait);
+	return ret;
+}
+
+/*
+ * Wait for the inode table of a group to be zeroed by someone else. Must be
+ * called with the group locked, which is dropped while waiting.
+ */
+static void jbfs_wait_inode_group(struct super_block *sb, uint64_t group)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_group_info *gi = &sbi->s_group_info[group];
+
+	while (gi->gi_flags & JBFS_GROUP_INODE_ZEROING) {
+		JBFS_GROUP_UNLOCK(sbi, group);
+		wait_event(sbi->s_inode_init_wait,
+			   !(READ_ONCE(gi->gi_flags) &
+			     JBFS_GROUP_INODE_ZEROING));
+		JBFS_GROUP_LOCK(sbi, group);
+	}
+}
+
+static int jbfs_lazyinit_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	uint64_t group = 0;
+	unsigned long start;
+	int ret;
+
+	set_user_nice(current, MAX_NICE);
+
+	while (group < sbi->s_num_groups && !kthread_should_stop()) {
+		struct jbfs_group_info *gi = &sbi->s_group_info[group];
+
+		if (!(READ_ONCE(gi->gi_flags) & JBFS_GROUP_INODE_UNINIT)) {
+			group += 1;
+			continue;
+		}
+
+		if (!sb_start_write_trylock(sb)) {
+			schedule_timeout_interruptible(HZ);
+			continue;
+		}
+
+		start = jiffies;
+		ret = 0;
+
+		JBFS_GROUP_LOCK(sbi, group);
+		if ((gi->gi_flags & JBFS_GROUP_INODE_UNINIT) &&
+		    !(gi->gi_flags & JBFS_GROUP_INODE_ZEROING))
+			ret = jbfs_init_inode_group(sb, group);
+		JBFS_GROUP_UNLOCK(sbi, group);
+
+		sb_end_write(sb);
+
+		if (ret) {
+			printk(KERN_WARNING
+			       "jbfs: zeroing inode table of group %llu failed with code %d\n",
+			       group, ret);
+			break;
+		}
+
+		group += 1;
+		schedule_timeout_interruptible(JBFS_LAZYINIT_MULT *
+					       (jiffies - start) + 1);
+	}
+
+	/*
+	 * Wait for jbfs_stop_lazyinit, which needs the task to still be
+	 * around.
+	 */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+/*
+ * Start zeroing the inode tables of uninitialized groups in the background.
+ * If the thread can't be started, groups are still initialized when an inode
+ * is first allocated in them. The thread must only run while the filesystem
+ * is writable: it is stopped before remounting read-only.
+ */
+void jbfs_start_lazyinit(struct super_block *sb)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct task_struct *task;
+	uint64_t group;
+
+	for (group = 0; group < sbi->s_num_groups; ++group) {
+		if (sbi->s_group_info[group].gi_flags & JBFS_GROUP_INODE_UNINIT)
+			break;
+	}
+
+	if (group >= sbi->s_num_groups)
+		return;
+
+	task = kthread_run(jbfs_lazyinit_thread, sb, "jbfs_lazyinit/%s",
+			   sb->s_id);
+	if (IS_ERR(task)) {
+		printk(KERN_WARNING
+		       "jbfs: unable to start lazyinit thread (%ld)\n",
+		       PTR_ERR(task));
+		return;
+	}
+
+	sbi->s_lazyinit_task = task;
+}
+
+void jbfs_stop_lazyinit(struct super_block *sb)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+
+	if (sbi->s_lazyinit_task) {
+		kthread_stop(sbi->s_lazyinit_task);
+		sbi->s_lazyinit_task = NULL;
+	}
+}
+
 struct inode *jbfs_new_inode(struct inode *dir, umode_t mode)
 {
 	struct super_block *sb = dir->i_sb;
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
 	struct inode *inode;
 	struct jbfs_inode_info *ji;
+	struct jbfs_group_info *gi;
 	struct buffer_head *bh;
 	uint64_t start, group;
 	uint64_t block;
-	uint32_t local, index;
+	uint32_t local, index, offset;
+	uint32_t bits = sb->s_blocksize * 8;
+	int contiguous;
 	int i;
 
-	start = dir->i_ino >> sbi->s_local_inode_bits;
+	if (S_ISDIR(mode))
+		start = jbfs_find_group_dir(sb, dir);
+	else
+		start = jbfs_find_group_other(sb, dir);
 	group = start;
 
 	do {
+		gi = &sbi->s_group_info[group];
+		if (!READ_ONCE(gi->gi_free_inodes))
+			goto next;
+
 		JBFS_GROUP_LOCK(sbi, group);
-		block = sbi->s_offset_group + group * sbi->s_group_size + 1;
 
-		for (local = 0; local < sbi->s_group_inodes;
-		     local += sb->s_blocksize * 8) {
+		jbfs_wait_inode_group(sb, group);
+		if ((gi->gi_flags & JBFS_GROUP_INODE_UNINIT) &&
+		    jbfs_init_inode_group(sb, group)) {
+			JBFS_GROUP_UNLOCK(sbi, group);
+			goto next;
+		}
+
+		/*
+		 * All inodes below the hint are in use, so the search starts
+		 * there, and moves the hint along as long as it doesn't skip
+		 * a bitmap block it couldn't read.
+		 */
+		contiguous = 1;
+		offset = gi->gi_inode_hint & (bits - 1);
+		local = gi->gi_inode_hint - offset;
+		block = sbi->s_offset_group + group * sbi->s_group_size + 1 +
+		    local / bits;
+
+		for (; local < sbi->s_group_inodes; local += bits, offset = 0) {
 			bh = sb_bread(sb, block++);
-			if (!bh)
+			if (!bh) {
+				contiguous = 0;
 				continue;
+			}
 
 			index =
-			    find_first_zero_bit((unsigned long *)bh->b_data,
-						sb->s_blocksize * 8);
+			    find_next_zero_bit((unsigned long *)bh->b_data,
+					       bits, offset);
 
 			if (local + index >= sbi->s_group_inodes) {
 				brelse(bh);
+				if (contiguous)
+					gi->gi_inode_hint = sbi->s_group_inodes;
 				break;
 			}
 
-			if (index < sb->s_blocksize * 8) {
+			if (index < bits) {
 				set_bit(index, (unsigned long *)bh->b_data);
 				mark_buffer_dirty(bh);
 				brelse(bh);
-				JBFS_GROUP_UNLOCK(sbi, group);
 				local += index;
+				if (contiguous)
+					gi->gi_inode_hint = local + 1;
 				goto found;
 			}
 
 			brelse(bh);
+			if (contiguous)
+				gi->gi_inode_hint = local + bits;
 		}
 
 		JBFS_GROUP_UNLOCK(sbi, group);
+ next:
 		if (++group >= sbi->s_num_groups)
 			group = 0;
 	} while (group != start);
@@ -59,6 +377,16 @@ struct inode *jbfs_new_inode(struct inode *dir, umode_t mode)
 	return ERR_PTR(-ENOSPC);
 
  found:
+	if (gi->gi_free_inodes) {
+		gi->gi_free_inodes -= 1;
+		percpu_counter_dec(&sbi->s_free_inodes);
+	}
+	if (S_ISDIR(mode)) {
+		gi->gi_used_dirs += 1;
+		percpu_counter_inc(&sbi->s_dirs);
+	}
+	jbfs_write_group_desc(sb, group);
+	JBFS_GROUP_UNLOCK(sbi, group);
 
 	inode = new_inode(sb);
 	ji = JBFS_I(inode);
@@ -75,8 +403,8 @@ struct inode *jbfs_new_inode(struct inode *dir, umode_t mode)
 		ji->i_extents[i][0] = 0;
 		ji->i_extents[i][1] = 0;
 	}
-	// TODO: Support i_cont
 	ji->i_cont = 0;
+	ji->i_tree_blocks = 0;
 
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
@@ -96,7 +424,12 @@ int jbfs_delete_inode(struct inode *inode)
 	uint64_t block =
 	    sbi->s_offset_group + group * sbi->s_group_size + 1 +
 	    (local >> (sbi->s_log_block_size + 3));
-	local &= sb->s_blocksize * 8 - 1;
+	struct jbfs_group_info *gi;
+
+	if (group >= sbi->s_num_groups)
+		return -EINVAL;
+
+	gi = &sbi->s_group_info[group];
 
 	JBFS_GROUP_LOCK(sbi, group);
 	bh = sb_bread(sb, block);
@@ -105,7 +438,18 @@ int jbfs_delete_inode(struct inode *inode)
 		goto out;
 	}
 
-	clear_bit(local, (unsigned long *)bh->b_data);
+	if (test_and_clear_bit(local & (sb->s_blocksize * 8 - 1),
+			       (unsigned long *)bh->b_data)) {
+		gi->gi_free_inodes += 1;
+		percpu_counter_inc(&sbi->s_free_inodes);
+		if (S_ISDIR(inode->i_mode) && gi->gi_used_dirs) {
+			gi->gi_used_dirs -= 1;
+			percpu_counter_dec(&sbi->s_dirs);
+		}
+		if (local < gi->gi_inode_hint)
+			gi->gi_inode_hint = local;
+		jbfs_write_group_desc(sb, group);
+	}
 	mark_buffer_dirty(bh);
 	brelse(bh);
 out:
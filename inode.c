@@ -7,85 +7,558 @@
 #include <linux/vfs.h>
 #include <linux/highuid.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/mpage.h>
 #include <linux/writeback.h>
 #include "jbfs.h"
 
+/*
+ * Allocate the blocks reserved by delayed allocation, which always follow
+ * the last extent. Must be called with the extent lock of the inode held.
+ */
+static int jbfs_alloc_reserved(struct inode *inode)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	int ret = 0;
+
+	while (ji->i_reserved) {
+		int n = min_t(uint64_t, ji->i_reserved, INT_MAX);
+		jbfs_new_blocks(inode, &n, 0, &ret);
+		if (ret) {
+			printk(KERN_WARNING
+			       "jbfs: delayed allocation for inode %lu failed with code %d\n",
+			       inode->i_ino, ret);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Map up to max blocks starting at lblock for writing, allocating whatever
+ * isn't written yet: holes are filled, unwritten extents are converted, and
+ * blocks past the last extent are allocated a whole contiguous run at a time.
+ * Blocks between the last extent and lblock are left as a hole.
+ * New blocks get the extent flags in flags, and unwritten extents are left
+ * alone if those include JBFS_EXTENT_UNWRITTEN. *block and *len are set to
+ * the run that was mapped. Returns 1 if the blocks are new, 0 if they were
+ * mapped already, or a negative error. Must be called with the extent lock
+ * of the inode held.
+ */
+static int jbfs_map_create(struct inode *inode, uint64_t lblock, uint64_t max,
+			   uint64_t flags, sector_t *block, uint64_t *len)
+{
+	struct jbfs_extent ext;
+	int n, ret;
+
+	ret = jbfs_extent_lookup(inode, lblock, &ext);
+	if (!ret) {
+		*block = ext.e_start + lblock - ext.e_lblock;
+		*len = min(ext.e_lblock + ext.e_len - lblock, max);
+
+		/*
+		 * Simplest case: blocks found, no allocation needed.
+		 */
+		if (!ext.e_flags || ext.e_flags == flags)
+			return 0;
+
+		if (ext.e_flags & JBFS_EXTENT_HOLE)
+			ret = jbfs_fill_hole(inode, lblock, len, block, flags);
+		else
+			ret = jbfs_convert_unwritten(inode, &ext, lblock, *len);
+		return ret ? ret : 1;
+	}
+
+	if (ret != -ENOENT)
+		return ret;
+
+	/*
+	 * Appends extend the last extent where they can. Anything further out
+	 * gets a run of its own, after any delayed blocks are allocated, as
+	 * those must stay right past the last extent.
+	 */
+	if (lblock > ext.e_lblock) {
+		if (JBFS_I(inode)->i_reserved) {
+			ret = jbfs_alloc_reserved(inode);
+			if (ret)
+				return ret;
+			return jbfs_map_create(inode, lblock, max, flags, block,
+					       len);
+		}
+
+		*len = max;
+		ret = jbfs_fill_hole(inode, lblock, len, block, flags);
+		return ret ? ret : 1;
+	}
+
+	n = min_t(uint64_t, max, INT_MAX);
+	*block = jbfs_new_blocks(inode, &n, flags, &ret);
+	if (ret)
+		return ret;
+
+	*len = n;
+	return 1;
+}
+
+/*
+ * Map up to bh_result->b_size bytes starting at iblock. When create is set,
+ * missing blocks are allocated, and bh_result->b_size is shrunk to the length
+ * of the run that was mapped. Only directories and symlinks still go through
+ * buffer heads; regular files use jbfs_iomap_ops.
+ */
 int jbfs_get_block(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create)
 {
 	struct jbfs_inode_info *jbfs_inode;
 	struct jbfs_sb_info *sbi;
+	struct jbfs_extent ext;
+	uint64_t max_blocks;
+	uint64_t len;
 	sector_t block;
-	int ret = -EIO;
-	int i;
+	int ret = 0;
 
 	jbfs_inode = JBFS_I(inode);
 	sbi = JBFS_SB(inode->i_sb);
-
-	for (i = 0; i < 12; ++i) {
-		uint64_t start = jbfs_inode->i_extents[i][0];
-		uint64_t end = jbfs_inode->i_extents[i][1];
-		uint64_t len = end - start + 1;
-		if (!start)
-			break;
-		if (iblock < len) {
-			block = start + iblock;
-			ret = 0;
-			break;
+	max_blocks = bh_result->b_size >> inode->i_blkbits;
+	if (!max_blocks)
+		max_blocks = 1;
+
+	mutex_lock(&jbfs_inode->i_extent_lock);
+
+	if (create) {
+		ret = jbfs_map_create(inode, iblock, max_blocks, 0, &block,
+				      &len);
+		mutex_unlock(&jbfs_inode->i_extent_lock);
+		if (ret < 0) {
+			printk(KERN_WARNING
+			       "jbfs: allocating new block for inode %lu failed with code %d\n",
+			       inode->i_ino, ret);
+			return ret;
 		}
-		iblock -= len;
+		if (ret)
+			set_buffer_new(bh_result);
+		goto out;
 	}
 
+	ret = jbfs_extent_lookup(inode, iblock, &ext);
+	mutex_unlock(&jbfs_inode->i_extent_lock);
+
 	/*
-	 * Simplest case: block found, no allocation needed.
+	 * Punching a hole at the end of a file can leave blocks inside it
+	 * that are past the last extent. They read as zeroes, just like
+	 * holes.
 	 */
-	if (ret == 0)
-		goto out;
-
-	if (!create)
+	if (ret == -ENOENT)
+		return 0;
+	if (ret)
 		return ret;
 
+	block = ext.e_start + iblock - ext.e_lblock;
+	len = min(ext.e_lblock + ext.e_len - iblock, max_blocks);
+
 	/*
-	 * Allocate new blocks one block at a time.
+	 * Holes and unwritten extents read as zeroes, so leave the buffer
+	 * unmapped.
 	 */
-	while (iblock--) {
-		jbfs_new_block(inode, &ret);
-		if (ret)
-			goto out_err;
+	if (ext.e_flags) {
+		bh_result->b_size = len << inode->i_blkbits;
+		return 0;
 	}
 
-	block = jbfs_new_block(inode, &ret);
-	if (ret)
-		goto out_err;
-
-	set_buffer_new(bh_result);
  out:
-	if (block >= sbi->s_num_blocks) {
+	if (block + len > sbi->s_num_blocks) {
 		printk(KERN_WARNING
 		       "jbfs: block %llu in inode %lu outside of filesystem\n",
 			block, inode->i_ino);
-		ret = -EIO;
-		goto out_err;
+		return -EIO;
 	}
 
 	map_bh(bh_result, inode->i_sb, block);
+	bh_result->b_size = len << inode->i_blkbits;
 	return 0;
+}
 
- out_err:
-	printk(KERN_WARNING
-	       "jbfs: allocating new block for inode %lu failed with code %d\n",
-	       inode->i_ino, ret);
+/*
+ * Allocate all delayed blocks of an inode at once, so they end up in as few
+ * extents as possible.
+ */
+static int jbfs_alloc_delayed(struct inode *inode)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	int ret;
+
+	mutex_lock(&ji->i_extent_lock);
+	ret = jbfs_alloc_reserved(inode);
+	mutex_unlock(&ji->i_extent_lock);
 	return ret;
 }
 
+/*
+ * Shrink *len to the number of blocks starting at block that aren't shared
+ * with other files, which is 0 if the first one is.
+ */
+static int jbfs_unshared_run(struct inode *inode, sector_t block,
+			     uint64_t *len)
+{
+	uint64_t n;
+	int refs, ret;
+
+	for (n = 0; n < *len; ++n) {
+		refs = jbfs_block_refs(inode->i_sb, block + n, &ret);
+		if (ret)
+			return ret;
+		if (refs > 1)
+			break;
+	}
+
+	*len = n;
+	return 0;
+}
+
+static int jbfs_set_iomap(struct inode *inode, struct iomap *iomap,
+			  uint64_t lblock, uint64_t len, sector_t block,
+			  u16 type, u16 flags)
+{
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)lblock << inode->i_blkbits;
+	iomap->length = (loff_t)len << inode->i_blkbits;
+	iomap->type = type;
+	iomap->flags = flags;
+	iomap->addr = IOMAP_NULL_ADDR;
+
+	if (type != IOMAP_MAPPED && type != IOMAP_UNWRITTEN)
+		return 0;
+
+	if (block + len > JBFS_SB(inode->i_sb)->s_num_blocks) {
+		printk(KERN_WARNING
+		       "jbfs: block %llu in inode %lu outside of filesystem\n",
+			block, inode->i_ino);
+		return -EIO;
+	}
+
+	iomap->addr = (u64)block << inode->i_blkbits;
+	return 0;
+}
+
+/*
+ * Map a range of a regular file for iomap. Reads map a whole extent at a
+ * time, and report holes, unwritten extents and blocks past the last extent
+ * as such. Writes allocate what isn't written yet, like jbfs_get_block does,
+ * except that with delayed allocation appends only reserve blocks, which
+ * jbfs_writepages allocates all at once. Zeroing leaves alone whatever
+ * reads as zeroes already.
+ *
+ * Direct writes allocate unwritten extents instead, which are converted once
+ * the data is on disk, so a crash can't expose stale blocks. Shared blocks
+ * can't be written in place; for those, -ENOTBLK makes the write fall back
+ * to the page cache, and writeback moves them.
+ */
+static int jbfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+			    unsigned flags, struct iomap *iomap,
+			    struct iomap *srcmap)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint64_t lblock = offset >> inode->i_blkbits;
+	uint64_t max = ((offset + length - 1) >> inode->i_blkbits) - lblock + 1;
+	struct jbfs_extent ext;
+	uint64_t len = max;
+	uint64_t end = 0;
+	sector_t block = 0;
+	u16 type = IOMAP_HOLE;
+	u16 iflags = 0;
+	int past_end = 0;
+	int ret;
+
+	if (flags & IOMAP_NOWAIT) {
+		if (!mutex_trylock(&ji->i_extent_lock))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&ji->i_extent_lock);
+	}
+
+	ret = jbfs_extent_lookup(inode, lblock, &ext);
+	if (!ret) {
+		block = ext.e_start + lblock - ext.e_lblock;
+		len = min(ext.e_lblock + ext.e_len - lblock, max);
+		if (!ext.e_flags)
+			type = IOMAP_MAPPED;
+		else if (ext.e_flags & JBFS_EXTENT_UNWRITTEN)
+			type = IOMAP_UNWRITTEN;
+	} else if (ret == -ENOENT) {
+		ret = 0;
+		past_end = 1;
+		end = ext.e_lblock;
+		if (lblock < end + ji->i_reserved) {
+			len = min(end + ji->i_reserved - lblock, max);
+			type = IOMAP_DELALLOC;
+		}
+	} else {
+		goto out;
+	}
+
+	if (!(flags & IOMAP_WRITE) || (flags & IOMAP_ZERO))
+		goto out;
+
+	if (type == IOMAP_MAPPED) {
+		if ((flags & IOMAP_DIRECT) &&
+		    (ji->i_flags & JBFS_INODE_SHARED)) {
+			ret = jbfs_unshared_run(inode, block, &len);
+			if (!ret && !len)
+				ret = -ENOTBLK;
+		}
+		goto out;
+	}
+
+	if ((flags & IOMAP_DIRECT) && type == IOMAP_UNWRITTEN)
+		goto out;
+
+	if (flags & IOMAP_NOWAIT) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	if (flags & IOMAP_DIRECT) {
+		ret = jbfs_map_create(inode, lblock, max, JBFS_EXTENT_UNWRITTEN,
+				      &block, &len);
+		if (ret < 0)
+			goto out;
+		type = IOMAP_MAPPED;
+		if (ret) {
+			type = IOMAP_UNWRITTEN;
+			iflags |= IOMAP_F_NEW;
+		}
+		ret = 0;
+		goto out;
+	}
+
+	/*
+	 * Holes and unwritten extents inside the file are filled in right
+	 * away, as are writes that leave a hole past the last extent; only
+	 * appends are delayed.
+	 */
+	if (past_end && jbfs_test_opt(inode->i_sb, DELALLOC) &&
+	    lblock <= end + ji->i_reserved) {
+		if (lblock < end + ji->i_reserved)
+			goto out;
+
+		/*
+		 * A mapping covers either blocks reserved before or new
+		 * ones, so jbfs_iomap_end knows what it may give back.
+		 */
+		type = IOMAP_DELALLOC;
+		iflags |= IOMAP_F_NEW;
+		len = max;
+		ret = jbfs_reserve_blocks(inode, len);
+		goto out;
+	}
+
+	ret = jbfs_map_create(inode, lblock, max, 0, &block, &len);
+	if (ret < 0)
+		goto out;
+	if (ret)
+		iflags |= IOMAP_F_NEW;
+	type = IOMAP_MAPPED;
+	ret = 0;
+
+ out:
+	mutex_unlock(&ji->i_extent_lock);
+	if (ret)
+		return ret;
+
+	return jbfs_set_iomap(inode, iomap, lblock, len, block, type, iflags);
+}
+
+/*
+ * Give back the blocks a short or failed write reserved but never copied
+ * anything into. Reservations only count blocks past the last extent, so
+ * only the end of them can be given back.
+ */
+static int jbfs_iomap_end(struct inode *inode, loff_t offset, loff_t length,
+			  ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	unsigned int blkbits = inode->i_blkbits;
+	uint64_t first, last, end;
+	int ret;
+
+	if (iomap->type != IOMAP_DELALLOC || !(iomap->flags & IOMAP_F_NEW))
+		return 0;
+
+	first = (offset + written + i_blocksize(inode) - 1) >> blkbits;
+	last = (iomap->offset + iomap->length) >> blkbits;
+	if (first >= last)
+		return 0;
+
+	mutex_lock(&ji->i_extent_lock);
+	ret = jbfs_extent_end(inode, &end);
+	if (!ret && end + ji->i_reserved == last)
+		jbfs_release_blocks(inode, last - max(first, end));
+	mutex_unlock(&ji->i_extent_lock);
+	return 0;
+}
+
+const struct iomap_ops jbfs_iomap_ops = {
+	.iomap_begin = jbfs_iomap_begin,
+	.iomap_end = jbfs_iomap_end,
+};
+
+/*
+ * Writeback caches the last mapping in the context. It is only reused while
+ * the extent list of the inode hasn't changed since, as truncate, fallocate
+ * and reflinks can all remap blocks under it.
+ */
+struct jbfs_writepage_ctx {
+	struct iomap_writepage_ctx ctx;
+	uint32_t seq;
+};
+
+/*
+ * Blocks shared with other files through reflinks are never written in
+ * place: writeback moves each shared block it writes to a block of its own.
+ * Only blocks of the page being written are allocated or unshared, since
+ * the data of any others isn't necessarily in the page cache.
+ */
+static int jbfs_map_blocks(struct iomap_writepage_ctx *wpc,
+			   struct inode *inode, loff_t offset)
+{
+	struct jbfs_writepage_ctx *jwpc =
+	    container_of(wpc, struct jbfs_writepage_ctx, ctx);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint64_t lblock = offset >> inode->i_blkbits;
+	uint64_t max = (PAGE_SIZE - offset_in_page(offset)) >> inode->i_blkbits;
+	struct jbfs_extent ext;
+	uint64_t len;
+	sector_t block;
+	int ret;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length &&
+	    jwpc->seq == READ_ONCE(ji->i_extent_seq))
+		return 0;
+
+	mutex_lock(&ji->i_extent_lock);
+
+	ret = jbfs_extent_lookup(inode, lblock, &ext);
+	if (ret && ret != -ENOENT)
+		goto out;
+
+	if (ret || ext.e_flags) {
+		ret = jbfs_map_create(inode, lblock, max, 0, &block, &len);
+		if (ret > 0)
+			ret = 0;
+		goto out;
+	}
+
+	block = ext.e_start + lblock - ext.e_lblock;
+	len = ext.e_lblock + ext.e_len - lblock;
+	if (!(ji->i_flags & JBFS_INODE_SHARED))
+		goto out;
+
+	/*
+	 * Map only as far as the blocks aren't shared, and not past the page
+	 * so the check stays cheap.
+	 */
+	len = min(len, max);
+	ret = jbfs_unshared_run(inode, block, &len);
+	if (ret || len)
+		goto out;
+
+	len = 1;
+	ret = jbfs_unshare_blocks(inode, lblock, &len, &block);
+	if (ret)
+		printk(KERN_WARNING
+		       "jbfs: unsharing block %llu of inode %lu failed with code %d\n",
+		       lblock, inode->i_ino, ret);
+
+ out:
+	jwpc->seq = ji->i_extent_seq;
+	mutex_unlock(&ji->i_extent_lock);
+	if (ret)
+		return ret;
+
+	return jbfs_set_iomap(inode, &wpc->iomap, lblock, len, block,
+			      IOMAP_MAPPED, 0);
+}
+
+static const struct iomap_writeback_ops jbfs_writeback_ops = {
+	.map_blocks = jbfs_map_blocks,
+};
+
+static int jbfs_iomap_readpage(struct file *file, struct page *page)
+{
+	return iomap_readpage(page, &jbfs_iomap_ops);
+}
+
+static void jbfs_iomap_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &jbfs_iomap_ops);
+}
+
+static int jbfs_iomap_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	struct jbfs_writepage_ctx wpc = { };
+
+	return iomap_writepage(page, wbc, &wpc.ctx, &jbfs_writeback_ops);
+}
+
+static int jbfs_iomap_writepages(struct address_space *mapping,
+				 struct writeback_control *wbc)
+{
+	struct jbfs_writepage_ctx wpc = { };
+	int ret;
+
+	ret = jbfs_alloc_delayed(mapping->host);
+	if (ret)
+		return ret;
+
+	return iomap_writepages(mapping, wbc, &wpc.ctx, &jbfs_writeback_ops);
+}
+
+static sector_t jbfs_iomap_bmap(struct address_space *mapping, sector_t block)
+{
+	return iomap_bmap(mapping, block, &jbfs_iomap_ops);
+}
+
+static const struct address_space_operations jbfs_iomap_aops = {
+	.readpage = jbfs_iomap_readpage,
+	.readahead = jbfs_iomap_readahead,
+	.writepage = jbfs_iomap_writepage,
+	.writepages = jbfs_iomap_writepages,
+	.set_page_dirty = iomap_set_page_dirty,
+	.releasepage = iomap_releasepage,
+	.invalidatepage = iomap_invalidatepage,
+	.bmap = jbfs_iomap_bmap,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.migratepage = iomap_migrate_page,
+	.direct_IO = noop_direct_IO,
+	.error_remove_page = generic_error_remove_page
+};
+
 static int jbfs_writepage(struct page *page, struct writeback_control *wbc)
 {
 	return block_write_full_page(page, jbfs_get_block, wbc);
 }
 
+static int jbfs_writepages(struct address_space *mapping,
+			   struct writeback_control *wbc)
+{
+	return mpage_writepages(mapping, wbc, jbfs_get_block);
+}
+
+/*
+ * jbfs_get_block maps as much of an extent as is asked for, so mpage can
+ * read a whole run of pages with a single bio.
+ */
 static int jbfs_readpage(struct file *file, struct page *page)
 {
-	return block_read_full_page(page, jbfs_get_block);
+	return mpage_readpage(page, jbfs_get_block);
+}
+
+static void jbfs_readahead(struct readahead_control *rac)
+{
+	mpage_readahead(rac, jbfs_get_block);
 }
 
 static void jbfs_write_failed(struct address_space *mapping, loff_t to)
@@ -121,7 +594,9 @@ static sector_t jbfs_bmap(struct address_space *mapping, sector_t block)
 
 static const struct address_space_operations jbfs_aops = {
 	.readpage = jbfs_readpage,
+	.readahead = jbfs_readahead,
 	.writepage = jbfs_writepage,
+	.writepages = jbfs_writepages,
 	.write_begin = jbfs_write_begin,
 	.write_end = generic_write_end,
 	.bmap = jbfs_bmap
@@ -132,19 +607,57 @@ static const struct inode_operations jbfs_symlink_inode_operations = {
 	.getattr = jbfs_getattr
 };
 
-static struct jbfs_inode *jbfs_raw_inode(struct super_block *sb,
-					 unsigned long ino,
-					 struct buffer_head **bh)
+/*
+ * Return the position of inode ino in the inode tables, in bytes.
+ */
+static uint64_t jbfs_inode_pos(struct super_block *sb, unsigned long ino)
 {
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
-	uint64_t group, local, pos;
+	uint64_t group, local;
 
 	ino -= 1;
 	group = ino >> sbi->s_local_inode_bits;
 	local = ino & ((1ull << sbi->s_local_inode_bits) - 1);
-	pos = (sbi->s_offset_group + sbi->s_offset_inodes +
-	       group * sbi->s_group_size) * sb->s_blocksize +
-	       local * JBFS_INODE_SIZE;
+	return (sbi->s_offset_group + sbi->s_offset_inodes +
+		group * sbi->s_group_size) * sb->s_blocksize +
+		local * JBFS_INODE_SIZE;
+}
+
+/*
+ * Start reading the inode table block that holds inode ino, without waiting
+ * for it. Nothing is read if the inode is cached already, or if its block is.
+ */
+void jbfs_inode_readahead(struct super_block *sb, unsigned long ino)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct inode *inode;
+	uint64_t group = (ino - 1) >> sbi->s_local_inode_bits;
+
+	if (!ino || group >= sbi->s_num_groups)
+		return;
+
+	/*
+	 * Tables that haven't been zeroed yet must not end up in the buffer
+	 * cache, where zeroing them wouldn't be seen.
+	 */
+	if (READ_ONCE(sbi->s_group_info[group].gi_flags) &
+	    JBFS_GROUP_INODE_UNINIT)
+		return;
+
+	rcu_read_lock();
+	inode = find_inode_by_ino_rcu(sb, ino);
+	rcu_read_unlock();
+	if (inode)
+		return;
+
+	sb_breadahead(sb, jbfs_inode_pos(sb, ino) >> sb->s_blocksize_bits);
+}
+
+static struct jbfs_inode *jbfs_raw_inode(struct super_block *sb,
+					 unsigned long ino,
+					 struct buffer_head **bh)
+{
+	uint64_t pos = jbfs_inode_pos(sb, ino);
 
 	*bh = sb_bread(sb, pos / sb->s_blocksize);
 	if (!*bh) {
@@ -161,7 +674,7 @@ void jbfs_set_inode(struct inode *inode, dev_t dev)
 	if (S_ISREG(inode->i_mode)) {
 		inode->i_op = &jbfs_file_inode_operations;
 		inode->i_fop = &jbfs_file_operations;
-		inode->i_mapping->a_ops = &jbfs_aops;
+		inode->i_mapping->a_ops = &jbfs_iomap_aops;
 	} else if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &jbfs_dir_inode_operations;
 		inode->i_fop = &jbfs_dir_operations;
@@ -221,6 +734,7 @@ struct inode *jbfs_iget(struct super_block *sb, unsigned long ino)
 	jbfs_decode_time(&inode->i_atime, le64_to_cpu(raw_inode->i_atime));
 	jbfs_decode_time(&inode->i_ctime, le64_to_cpu(raw_inode->i_ctime));
 	jbfs_inode->i_cont = le64_to_cpu(raw_inode->i_cont);
+	jbfs_inode->i_tree_blocks = le64_to_cpu(raw_inode->i_tree_blocks);
 
 	inode->i_blocks = 0;
 	for (i = 0; i < 12; ++i) {
@@ -259,7 +773,7 @@ int jbfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 	raw_inode->i_uid = cpu_to_le16(fs_high2lowuid(i_uid_read(inode)));
 	raw_inode->i_gid = cpu_to_le16(fs_high2lowuid(i_uid_read(inode)));
 	raw_inode->i_size = cpu_to_le64(inode->i_size);
-	raw_inode->i_flags = cpu_to_le64(jbfs_inode->i_flags);
+	raw_inode->i_flags = cpu_to_le32(jbfs_inode->i_flags);
 	raw_inode->i_mtime = cpu_to_le64(jbfs_encode_time(&inode->i_mtime));
 	raw_inode->i_atime = cpu_to_le64(jbfs_encode_time(&inode->i_atime));
 	raw_inode->i_ctime = cpu_to_le64(jbfs_encode_time(&inode->i_ctime));
@@ -274,6 +788,7 @@ int jbfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 			    cpu_to_le64(jbfs_inode->i_extents[i][1]);
 		}
 	raw_inode->i_cont = cpu_to_le64(jbfs_inode->i_cont);
+	raw_inode->i_tree_blocks = cpu_to_le64(jbfs_inode->i_tree_blocks);
 
 	mark_buffer_dirty(bh);
 	if (wbc->sync_mode == WB_SYNC_ALL && buffer_dirty(bh)) {
@@ -295,6 +810,10 @@ void jbfs_evict_inode(struct inode *inode)
 		inode->i_size = 0;
 		jbfs_truncate(inode);
 	}
+	if (JBFS_I(inode)->i_reserved)
+		jbfs_release_blocks(inode, JBFS_I(inode)->i_reserved);
+	jbfs_discard_window(inode);
+	jbfs_drop_extent_cache(inode);
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 	if (!inode->i_nlink)
@@ -308,18 +827,13 @@ int jbfs_getattr(const struct path *path, struct kstat *stat, u32 request_mask,
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
 	struct inode *inode = d_inode(path->dentry);
 	struct jbfs_inode_info *ji = JBFS_I(inode);
-	int i;
 
 	generic_fillattr(inode, stat);
 
-	// TODO: support i_cont
-	stat->blocks = 0;
-	for (i = 0; i < 12; ++i) {
-		uint64_t start = ji->i_extents[i][0];
-		uint64_t end = ji->i_extents[i][1];
-		stat->blocks +=
-		    (end - start + !!start) << (sbi->s_log_block_size - 9);
-	}
+	mutex_lock(&ji->i_extent_lock);
+	stat->blocks = (jbfs_extent_blocks(inode) + ji->i_reserved) <<
+	    (sbi->s_log_block_size - 9);
+	mutex_unlock(&ji->i_extent_lock);
 
 	stat->blksize = sb->s_blocksize;
 	return 0;
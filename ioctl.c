@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2020, 2021 Julian Blaauboer
+
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+#include "jbfs.h"
+
+static long jbfs_ioc_fitrim(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range range;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+	ret = jbfs_trim_fs(sb, &range);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long jbfs_ioc_defrag(struct file *file, void __user *arg)
+{
+	struct jbfs_defrag_range range;
+	int ret;
+
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	ret = jbfs_defrag(file, &range);
+	mnt_drop_write_file(file);
+
+	/*
+	 * Report progress even if the defragmentation was interrupted.
+	 */
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+
+	return ret;
+}
+
+static long jbfs_ioc_extent_count(struct file *file, __u64 __user *arg)
+{
+	struct inode *inode = file_inode(file);
+	struct jbfs_inode_info *ji = JBFS_I(inode);
+	uint64_t count;
+	int ret;
+
+	mutex_lock(&ji->i_extent_lock);
+	ret = jbfs_extent_count(inode, &count);
+	mutex_unlock(&ji->i_extent_lock);
+	if (ret)
+		return ret;
+
+	return put_user(count, arg);
+}
+
+long jbfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FITRIM:
+		return jbfs_ioc_fitrim(file, (void __user *)arg);
+	case JBFS_IOC_DEFRAG:
+		return jbfs_ioc_defrag(file, (void __user *)arg);
+	case JBFS_IOC_EXTENT_COUNT:
+		return jbfs_ioc_extent_count(file, (__u64 __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -6,15 +6,31 @@
 
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include "jbfs_ioctl.h"
 
 #define JBFS_SUPER_MAGIC 0x12050109
 #define JBFS_TIME_SECOND_BITS 54
 #define JBFS_LINK_MAX 65535
-#define JBFS_GROUP_N_LOCKS 32
+#define JBFS_MAX_REFS 255
 #define JBFS_INODE_SIZE 256
+#define JBFS_MIN_WINDOW 8
+#define JBFS_MAX_WINDOW 2048
+#define JBFS_STREAM_BLOCKS 16
 
 #define JBFS_SB(sb) ((struct jbfs_sb_info *)sb->s_fs_info)
 
+#define JBFS_MOUNT_DELALLOC 0x0001
+#define JBFS_MOUNT_DISCARD 0x0002
+
+#define jbfs_test_opt(sb, opt) (JBFS_SB(sb)->s_mount_opt & JBFS_MOUNT_##opt)
+
 struct jbfs_super_block {
 	__le32 s_magic;
 	__le32 s_log_block_size;
@@ -30,12 +46,53 @@ struct jbfs_super_block {
 	__le32 s_offset_refmap;
 	__le32 s_offset_data;
 	__le32 s_checksum;
+	__le32 s_reserved;
+	__le64 s_free_blocks;
+	__le64 s_free_inodes;
+};
+
+struct jbfs_free_extent {
+	struct rb_node fe_start_node;
+	struct rb_node fe_len_node;
+	uint32_t fe_start;
+	uint32_t fe_len;
+};
+
+struct jbfs_group_info {
+	struct rb_root gi_free_by_start;
+	struct rb_root gi_free_by_len;
+	unsigned long *gi_used;
+	unsigned long *gi_full;
+	struct mutex gi_lock;
+	int gi_loaded;
+	uint32_t gi_generation;
+	uint32_t gi_free_blocks;
+	uint32_t gi_free_inodes;
+	uint32_t gi_used_dirs;
+	uint32_t gi_inode_hint;
+	uint32_t gi_flags;
 };
 
 struct jbfs_sb_info {
 	struct jbfs_super_block *s_js;
 	struct buffer_head *s_sbh;
-	struct mutex s_group_lock[JBFS_GROUP_N_LOCKS];
+	struct jbfs_group_info *s_group_info;
+	uint64_t __percpu *s_alloc_rotor;
+	struct super_block *s_sb;
+	spinlock_t s_discard_lock;
+	struct list_head s_discard_list;
+	struct delayed_work s_discard_work;
+	spinlock_t s_ecache_lock;
+	struct list_head s_ecache_list;
+	unsigned long s_ecache_count;
+	struct shrinker s_ecache_shrinker;
+	struct task_struct *s_lazyinit_task;
+	wait_queue_head_t s_inode_init_wait;
+	unsigned long s_mount_opt;
+	struct percpu_counter s_free_blocks;
+	struct percpu_counter s_free_inodes;
+	struct percpu_counter s_dirs;
+	atomic64_t s_reserved_blocks;
 	uint32_t s_log_block_size;
 	uint64_t s_flags;
 	uint64_t s_num_blocks;
@@ -50,16 +107,37 @@ struct jbfs_sb_info {
 	uint32_t s_offset_data;
 };
 
-#define JBFS_GROUP_LOCK(sbi, group) mutex_lock(&sbi->s_group_lock[group % JBFS_GROUP_N_LOCKS])
-#define JBFS_GROUP_UNLOCK(sbi, group) mutex_unlock(&sbi->s_group_lock[group % JBFS_GROUP_N_LOCKS])
+#define JBFS_GROUP_LOCK(sbi, group) mutex_lock(&sbi->s_group_info[group].gi_lock)
+#define JBFS_GROUP_UNLOCK(sbi, group) mutex_unlock(&sbi->s_group_info[group].gi_lock)
 
 struct jbfs_group_descriptor {
 	__le32 g_magic;
 	__le32 g_free_inodes;
 	__le32 g_free_blocks;
 	__le32 g_checksum;
+	__le32 g_used_dirs;
+	__le32 g_flags;
 };
 
+/*
+ * The inode bitmap and inode table of the group have never been written, and
+ * all of its inodes are free.
+ */
+#define JBFS_GROUP_INODE_UNINIT 0x0001
+
+/*
+ * In memory only: the inode table of the group is being zeroed, and the group
+ * lock has been dropped meanwhile. Inode allocation in the group waits for it
+ * on s_inode_init_wait.
+ */
+#define JBFS_GROUP_INODE_ZEROING 0x8000
+
+/*
+ * Inode flags. JBFS_INODE_SHARED is set once a file has shared blocks with
+ * another file through a reflink, and is never cleared.
+ */
+#define JBFS_INODE_SHARED 0x0001
+
 struct jbfs_inode {
 	__le16 i_mode;
 	__le16 i_nlinks;
@@ -72,12 +150,67 @@ struct jbfs_inode {
 	__le64 i_ctime;
 	__le64 i_extents[12][2];
 	__le64 i_cont;
+	__le64 i_tree_blocks;
 };
 
+/*
+ * Extent flags, stored in the top bits of both the start and end of an
+ * extent.
+ */
+#define JBFS_EXTENT_UNWRITTEN (1ULL << 63)
+#define JBFS_EXTENT_HOLE (1ULL << 62)
+#define JBFS_EXTENT_FLAGS (JBFS_EXTENT_UNWRITTEN | JBFS_EXTENT_HOLE)
+
+#define JBFS_TREE_MAGIC 0x4a425458
+#define JBFS_TREE_MAX_DEPTH 8
+
+/*
+ * Every block of the extent tree starts with a header, followed by index
+ * entries, or by leaf entries if th_depth is 0.
+ */
+struct jbfs_tree_header {
+	__le32 th_magic;
+	__le16 th_entries;
+	__le16 th_depth;
+	__le64 th_reserved;
+};
+
+struct jbfs_tree_index {
+	__le64 ti_lblock;
+	__le64 ti_block;
+};
+
+struct jbfs_tree_leaf {
+	__le64 tl_lblock;
+	__le64 tl_start;
+	__le64 tl_len;
+};
+
+struct jbfs_extent {
+	uint64_t e_lblock;
+	uint64_t e_start;
+	uint64_t e_len;
+	uint64_t e_flags;
+};
+
+struct jbfs_extent_cache;
+
 struct jbfs_inode_info {
 	uint32_t i_flags;
 	uint64_t i_extents[12][2];
 	uint64_t i_cont;
+	uint64_t i_tree_blocks;
+	struct jbfs_extent_cache *i_ecache;
+	struct mutex i_extent_lock;
+	uint32_t i_extent_seq;
+	uint64_t i_reserved;
+	uint64_t i_window_start;
+	uint32_t i_window_len;
+	uint32_t i_window_size;
+	uint32_t i_window_gen;
+	uint64_t i_ra_pos;
+	uint64_t i_ra_next;
+	uint32_t i_ra_window;
 	struct inode vfs_inode;
 };
 
@@ -106,18 +239,99 @@ static inline void jbfs_decode_time(struct timespec64 *ts, uint64_t time)
 	ts->tv_nsec = (0x3ff & time) * 1000000;
 }
 
+/*
+ * The refmap is scanned a word at a time rather than a byte at a time.
+ * jbfs_refmap_free returns the number of free (zero) bytes at the start of
+ * map and jbfs_refmap_used the number of used (nonzero) ones, looking at no
+ * more than len bytes. They live here so jbfs_refmap_test can check them.
+ */
+static inline uint32_t jbfs_refmap_free(const uint8_t *map, uint32_t len)
+{
+	const uint8_t *used = memchr_inv(map, 0, len);
+
+	return used ? used - map : len;
+}
+
+static inline uint32_t jbfs_refmap_used(const uint8_t *map, uint32_t len)
+{
+	const unsigned long ones = REPEAT_BYTE(0x01);
+	const unsigned long highs = REPEAT_BYTE(0x80);
+	uint32_t i = 0;
+
+	while (i < len &&
+	       !IS_ALIGNED((unsigned long)(map + i), sizeof(unsigned long))) {
+		if (!map[i])
+			return i;
+		i += 1;
+	}
+
+	/*
+	 * A word contains a zero byte iff subtracting one from every byte
+	 * borrows into a high bit that wasn't set before.
+	 */
+	for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+		unsigned long w = *(const unsigned long *)(map + i);
+
+		if ((w - ones) & ~w & highs)
+			break;
+	}
+
+	while (i < len && map[i])
+		i += 1;
+
+	return i;
+}
+
 int jbfs_get_block(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create);
 void jbfs_set_inode(struct inode *inode, dev_t dev);
 struct inode *jbfs_iget(struct super_block *sb, unsigned long ino);
+void jbfs_inode_readahead(struct super_block *sb, unsigned long ino);
 int jbfs_write_inode(struct inode *inode, struct writeback_control *wbc);
 void jbfs_evict_inode(struct inode *inode);
 
-uint64_t jbfs_new_block(struct inode *inode, int *err);
+int jbfs_init_group_info(struct super_block *sb);
+void jbfs_destroy_group_info(struct super_block *sb);
+void jbfs_write_group_desc(struct super_block *sb, uint64_t group);
+uint64_t jbfs_avail_blocks(struct jbfs_sb_info *sbi);
+int jbfs_reserve_blocks(struct inode *inode, uint64_t n);
+void jbfs_release_blocks(struct inode *inode, uint64_t n);
+void jbfs_discard_window(struct inode *inode);
+int jbfs_dealloc_blocks(struct super_block *sb, uint64_t start, int n, int *err);
+int jbfs_block_refs(struct super_block *sb, uint64_t block, int *err);
+int jbfs_ref_blocks(struct super_block *sb, uint64_t start, int n, int *err);
+uint64_t jbfs_alloc_run(struct inode *inode, int *n, int *err);
+uint64_t jbfs_new_blocks(struct inode *inode, int *n, uint64_t flags, int *err);
 void jbfs_truncate(struct inode *inode);
+int jbfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+int jbfs_init_extent_cache(struct super_block *sb);
+void jbfs_destroy_extent_cache(struct super_block *sb);
+void jbfs_drop_extent_cache(struct inode *inode);
+int jbfs_extent_lookup(struct inode *inode, uint64_t lblock,
+		       struct jbfs_extent *ext);
+uint64_t jbfs_extent_blocks(struct inode *inode);
+int jbfs_extent_end(struct inode *inode, uint64_t *end);
+int jbfs_extent_count(struct inode *inode, uint64_t *count);
+int jbfs_extent_set(struct inode *inode, uint64_t lblock, uint64_t len,
+		    uint64_t start, uint64_t flags, int release);
+int jbfs_extent_collapse(struct inode *inode, uint64_t lblock, uint64_t len);
+int jbfs_extent_truncate(struct inode *inode, uint64_t lblock);
+int jbfs_fill_hole(struct inode *inode, uint64_t lblock, uint64_t *len,
+		   sector_t *block, uint64_t flags);
+int jbfs_unshare_blocks(struct inode *inode, uint64_t lblock, uint64_t *len,
+			sector_t *block);
+int jbfs_convert_unwritten(struct inode *inode, const struct jbfs_extent *ext,
+			   uint64_t lblock, uint64_t len);
+int jbfs_convert_range(struct inode *inode, uint64_t lblock, uint64_t len);
+int jbfs_prealloc_blocks(struct inode *inode, uint64_t lblock, uint64_t len);
+int jbfs_zero_blocks(struct inode *inode, uint64_t lblock, uint64_t len);
+int jbfs_punch_blocks(struct inode *inode, uint64_t lblock, uint64_t len);
 
 struct inode *jbfs_new_inode(struct inode *dir, umode_t mode);
 int jbfs_delete_inode(struct inode *inode);
+void jbfs_start_lazyinit(struct super_block *sb);
+void jbfs_stop_lazyinit(struct super_block *sb);
 
 int jbfs_set_link(struct inode *dir, struct jbfs_dirent *de, struct page *page,
 		  struct inode *inode);
@@ -130,6 +344,10 @@ int jbfs_empty_dir(struct inode *inode);
 int jbfs_make_empty(struct inode *inode, struct inode *parent);
 ino_t jbfs_inode_by_name(struct dentry *dentry);
 
+int jbfs_defrag(struct file *file, struct jbfs_defrag_range *range);
+
+long jbfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 int jbfs_getattr(const struct path *path, struct kstat *stat, u32 request_mask,
 		 unsigned int flags);
 
@@ -137,4 +355,5 @@ extern const struct file_operations jbfs_dir_operations;
 extern const struct inode_operations jbfs_dir_inode_operations;
 extern const struct file_operations jbfs_file_operations;
 extern const struct inode_operations jbfs_file_inode_operations;
+extern const struct iomap_ops jbfs_iomap_ops;
 #endif
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2020, 2021 Julian Blaauboer
+
+#ifndef JBFS_IOCTL_H
+#define JBFS_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Move the data in [start, start + len) blocks of a file into contiguous
+ * runs of blocks. A len of 0 means up to the end of the file. On return,
+ * moved is set to the number of blocks that were moved.
+ */
+struct jbfs_defrag_range {
+	__u64 start;
+	__u64 len;
+	__u64 moved;
+};
+
+#define JBFS_IOC_DEFRAG _IOWR('J', 1, struct jbfs_defrag_range)
+#define JBFS_IOC_EXTENT_COUNT _IOR('J', 2, __u64)
+
+#endif
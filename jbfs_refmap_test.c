@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2020, 2021 Julian Blaauboer
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/prandom.h>
+#include "jbfs.h"
+
+/*
+ * KUnit checks and microbenchmark of the word at a time refmap scanners,
+ * against the byte loops they replaced. Built as a separate module when the
+ * kernel has CONFIG_KUNIT; the results show up in the kernel log.
+ */
+#define JBFS_TEST_MAP_SIZE 4096
+#define JBFS_TEST_ITERATIONS 10000
+
+enum {
+	JBFS_TEST_FREE,
+	JBFS_TEST_USED,
+	JBFS_TEST_MIXED,
+	JBFS_TEST_PATTERNS
+};
+
+static const char *const jbfs_test_names[] = {
+	[JBFS_TEST_FREE] = "all free",
+	[JBFS_TEST_USED] = "all used",
+	[JBFS_TEST_MIXED] = "mixed",
+};
+
+static uint32_t jbfs_bytes_free(const uint8_t *map, uint32_t len)
+{
+	uint32_t i = 0;
+
+	while (i < len && !map[i])
+		i += 1;
+
+	return i;
+}
+
+static uint32_t jbfs_bytes_used(const uint8_t *map, uint32_t len)
+{
+	uint32_t i = 0;
+
+	while (i < len && map[i])
+		i += 1;
+
+	return i;
+}
+
+/*
+ * Used bytes take every nonzero value, including the ones that are easy to
+ * get wrong in the zero byte test: 0x01, 0x80 and 0xff.
+ */
+static uint8_t jbfs_test_used_byte(struct rnd_state *rnd)
+{
+	static const uint8_t edges[] = { 0x01, 0x80, 0xff };
+	uint32_t r = prandom_u32_state(rnd);
+
+	if (r & 1)
+		return edges[(r >> 1) % ARRAY_SIZE(edges)];
+
+	return (r >> 8) % 255 + 1;
+}
+
+static void jbfs_test_fill(uint8_t *map, uint32_t len, int pattern)
+{
+	struct rnd_state rnd;
+	uint32_t i = 0, run, end;
+	bool used = false;
+
+	prandom_seed_state(&rnd, 0x12050109);
+
+	switch (pattern) {
+	case JBFS_TEST_FREE:
+		memset(map, 0, len);
+		break;
+	case JBFS_TEST_USED:
+		for (i = 0; i < len; ++i)
+			map[i] = jbfs_test_used_byte(&rnd);
+		break;
+	case JBFS_TEST_MIXED:
+		while (i < len) {
+			run = prandom_u32_state(&rnd) % 64 + 1;
+			end = min(i + run, len);
+
+			for (; i < end; ++i)
+				map[i] = used ? jbfs_test_used_byte(&rnd) : 0;
+
+			used = !used;
+		}
+		break;
+	}
+}
+
+static void jbfs_test_compare(struct kunit *test, const uint8_t *map,
+			      uint32_t len)
+{
+	KUNIT_EXPECT_EQ(test, jbfs_refmap_free(map, len),
+			jbfs_bytes_free(map, len));
+	KUNIT_EXPECT_EQ(test, jbfs_refmap_used(map, len),
+			jbfs_bytes_used(map, len));
+}
+
+/*
+ * Every pattern is checked at every alignment with lengths around the word
+ * size, and the mixed one from every start up to its end.
+ */
+static void jbfs_refmap_test_scan(struct kunit *test)
+{
+	static const uint32_t lens[] = { 0, 1, 7, 8, 9, 15, 16, 17, 63, 64, 65 };
+	uint32_t offset, i;
+	uint8_t *buf;
+	int pattern;
+
+	buf = kunit_kmalloc(test, JBFS_TEST_MAP_SIZE + 2 * sizeof(long),
+			    GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	for (pattern = 0; pattern < JBFS_TEST_PATTERNS; ++pattern) {
+		jbfs_test_fill(buf, JBFS_TEST_MAP_SIZE + 2 * sizeof(long),
+			       pattern);
+
+		for (offset = 0; offset < 2 * sizeof(long); ++offset) {
+			for (i = 0; i < ARRAY_SIZE(lens); ++i)
+				jbfs_test_compare(test, buf + offset, lens[i]);
+
+			jbfs_test_compare(test, buf + offset,
+					  JBFS_TEST_MAP_SIZE);
+		}
+	}
+
+	jbfs_test_fill(buf, JBFS_TEST_MAP_SIZE, JBFS_TEST_MIXED);
+	for (offset = 0; offset < JBFS_TEST_MAP_SIZE; ++offset)
+		jbfs_test_compare(test, buf + offset,
+				  JBFS_TEST_MAP_SIZE - offset);
+}
+
+/*
+ * Split map into alternating free and used runs, the way the free run index
+ * is built from it. Returns the number of runs, so the result can be checked
+ * and the scan isn't optimized away.
+ */
+static uint32_t jbfs_test_runs(const uint8_t *map, uint32_t len, bool words)
+{
+	uint32_t i = 0, runs = 0;
+
+	while (i < len) {
+		if (words)
+			i += jbfs_refmap_free(map + i, len - i);
+		else
+			i += jbfs_bytes_free(map + i, len - i);
+
+		if (words)
+			i += jbfs_refmap_used(map + i, len - i);
+		else
+			i += jbfs_bytes_used(map + i, len - i);
+
+		runs += 1;
+	}
+
+	return runs;
+}
+
+static u64 jbfs_test_time(const uint8_t *map, bool words, uint32_t *runs)
+{
+	u64 start = ktime_get_ns();
+	int i;
+
+	*runs = 0;
+	for (i = 0; i < JBFS_TEST_ITERATIONS; ++i)
+		*runs += jbfs_test_runs(map, JBFS_TEST_MAP_SIZE, words);
+
+	return ktime_get_ns() - start;
+}
+
+static void jbfs_refmap_test_bench(struct kunit *test)
+{
+	uint32_t byte_runs, word_runs;
+	u64 bytes, words;
+	uint8_t *map;
+	int pattern;
+
+	map = kunit_kmalloc(test, JBFS_TEST_MAP_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, map);
+
+	for (pattern = 0; pattern < JBFS_TEST_PATTERNS; ++pattern) {
+		jbfs_test_fill(map, JBFS_TEST_MAP_SIZE, pattern);
+
+		bytes = jbfs_test_time(map, false, &byte_runs);
+		words = jbfs_test_time(map, true, &word_runs);
+		KUNIT_EXPECT_EQ(test, byte_runs, word_runs);
+
+		kunit_info(test,
+			   "%s: byte loop %llu ns, word at a time %llu ns per %u byte refmap\n",
+			   jbfs_test_names[pattern],
+			   bytes / JBFS_TEST_ITERATIONS,
+			   words / JBFS_TEST_ITERATIONS, JBFS_TEST_MAP_SIZE);
+	}
+}
+
+static struct kunit_case jbfs_refmap_test_cases[] = {
+	KUNIT_CASE(jbfs_refmap_test_scan),
+	KUNIT_CASE(jbfs_refmap_test_bench),
+	{}
+};
+
+static struct kunit_suite jbfs_refmap_test_suite = {
+	.name = "jbfs_refmap",
+	.test_cases = jbfs_refmap_test_cases,
+};
+
+kunit_test_suite(jbfs_refmap_test_suite);
+
+MODULE_LICENSE("GPL");
@@ -9,7 +9,11 @@
 #include <linux/init.h>
 #include <linux/vfs.h>
 #include <linux/iversion.h>
+#include <linux/blkdev.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <linux/fs.h>
+#include <linux/statfs.h>
 #include "jbfs.h"
 
 static struct kmem_cache *jbfs_inode_cache;
@@ -22,6 +26,14 @@ static struct inode *jbfs_alloc_inode(struct super_block *sb)
 		return NULL;
 	}
 
+	ji->i_extent_seq = 0;
+	ji->i_reserved = 0;
+	ji->i_window_len = 0;
+	ji->i_window_size = 0;
+	ji->i_ra_pos = 0;
+	ji->i_ra_next = 0;
+	ji->i_ra_window = 0;
+	ji->i_ecache = NULL;
 	inode_set_iversion(&ji->vfs_inode, 1);
 	return &ji->vfs_inode;
 }
@@ -31,23 +43,158 @@ static void jbfs_free_inode(struct inode *inode)
 	kmem_cache_free(jbfs_inode_cache, JBFS_I(inode));
 }
 
+/*
+ * The free counts in the super block are a snapshot of the per-CPU counters,
+ * for tools that read the device. They are not used when mounting.
+ */
+static void jbfs_write_super(struct super_block *sb, int wait)
+{
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	struct jbfs_super_block *js = sbi->s_js;
+
+	lock_buffer(sbi->s_sbh);
+	js->s_free_blocks =
+	    cpu_to_le64(percpu_counter_sum_positive(&sbi->s_free_blocks));
+	js->s_free_inodes =
+	    cpu_to_le64(percpu_counter_sum_positive(&sbi->s_free_inodes));
+	unlock_buffer(sbi->s_sbh);
+
+	mark_buffer_dirty(sbi->s_sbh);
+	if (wait)
+		sync_dirty_buffer(sbi->s_sbh);
+}
+
 static void jbfs_put_super(struct super_block *sb)
 {
 	struct jbfs_sb_info *sbi = JBFS_SB(sb);
 
+	jbfs_stop_lazyinit(sb);
+
+	if (!sb_rdonly(sb))
+		jbfs_write_super(sb, 1);
+
+	jbfs_destroy_extent_cache(sb);
+	jbfs_destroy_group_info(sb);
 	sb->s_fs_info = NULL;
 	brelse(sbi->s_sbh);
 	kfree(sbi);
 }
 
+static int jbfs_sync_fs(struct super_block *sb, int wait)
+{
+	jbfs_write_super(sb, wait);
+	return 0;
+}
+
+/*
+ * The lazyinit thread only runs while the filesystem is writable, so it is
+ * stopped when remounting read-only and started again when remounting
+ * read-write.
+ */
+static int jbfs_remount(struct super_block *sb, int *flags, char *data)
+{
+	sync_filesystem(sb);
+
+	if (!(*flags & SB_RDONLY) == !sb_rdonly(sb))
+		return 0;
+
+	if (*flags & SB_RDONLY)
+		jbfs_stop_lazyinit(sb);
+	else
+		jbfs_start_lazyinit(sb);
+
+	return 0;
+}
+
+static int jbfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct jbfs_sb_info *sbi = JBFS_SB(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = sb->s_magic;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->s_num_groups * sbi->s_group_data_blocks;
+	buf->f_bfree = percpu_counter_read_positive(&sbi->s_free_blocks);
+	buf->f_bavail = jbfs_avail_blocks(sbi);
+	buf->f_files = sbi->s_num_groups * sbi->s_group_inodes;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->s_free_inodes);
+	buf->f_namelen = 255;
+	buf->f_fsid = u64_to_fsid(id);
+	return 0;
+}
+
+static int jbfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+
+	if (jbfs_test_opt(sb, DELALLOC))
+		seq_puts(seq, ",delalloc");
+	if (jbfs_test_opt(sb, DISCARD))
+		seq_puts(seq, ",discard");
+
+	return 0;
+}
+
 static const struct super_operations jbfs_sops = {
 	.alloc_inode = jbfs_alloc_inode,
 	.free_inode = jbfs_free_inode,
 	.write_inode = jbfs_write_inode,
 	.evict_inode = jbfs_evict_inode,
 	.put_super = jbfs_put_super,
+	.sync_fs = jbfs_sync_fs,
+	.remount_fs = jbfs_remount,
+	.statfs = jbfs_statfs,
+	.show_options = jbfs_show_options,
+};
+
+enum {
+	Opt_delalloc, Opt_nodelalloc, Opt_discard, Opt_nodiscard, Opt_err
 };
 
+static const match_table_t tokens = {
+	{Opt_delalloc, "delalloc"},
+	{Opt_nodelalloc, "nodelalloc"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_err, NULL}
+};
+
+static int jbfs_parse_options(char *options, struct jbfs_sb_info *sbi)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_delalloc:
+			sbi->s_mount_opt |= JBFS_MOUNT_DELALLOC;
+			break;
+		case Opt_nodelalloc:
+			sbi->s_mount_opt &= ~JBFS_MOUNT_DELALLOC;
+			break;
+		case Opt_discard:
+			sbi->s_mount_opt |= JBFS_MOUNT_DISCARD;
+			break;
+		case Opt_nodiscard:
+			sbi->s_mount_opt &= ~JBFS_MOUNT_DISCARD;
+			break;
+		default:
+			printk(KERN_ERR
+			       "jbfs: unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 static int jbfs_sanity_check(struct jbfs_sb_info *sbi)
 {
 	const char *msg = "unknown error";
@@ -87,7 +234,6 @@ static int jbfs_fill_super(struct super_block *sb, void *data, int silent)
 	int sb_block, sb_offset;
 	int blocksize;
 	int ret = -ENOMEM;
-	int i;
 
 	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
 	if (!sbi) {
@@ -95,6 +241,7 @@ static int jbfs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 
 	sb->s_fs_info = sbi;
+	sbi->s_sb = sb;
 	ret = -EINVAL;
 
 	blocksize = sb_min_blocksize(sb, 1024);
@@ -153,15 +300,32 @@ static int jbfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (!jbfs_sanity_check(sbi))
 		goto failed_mount;
 
-	for (i = 0; i < JBFS_GROUP_N_LOCKS; ++i)
-		mutex_init(&sbi->s_group_lock[i]);
+	if (!jbfs_parse_options(data, sbi))
+		goto failed_mount;
+
+	if (jbfs_test_opt(sb, DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		printk(KERN_WARNING
+		       "jbfs: device does not support discard, ignoring option\n");
+		sbi->s_mount_opt &= ~JBFS_MOUNT_DISCARD;
+	}
+
+	ret = jbfs_init_group_info(sb);
+	if (ret) {
+		printk(KERN_ERR "jbfs: unable to allocate group info.\n");
+		goto failed_mount;
+	}
+
+	ret = jbfs_init_extent_cache(sb);
+	if (ret) {
+		printk(KERN_ERR "jbfs: unable to register shrinker.\n");
+		goto failed_mount;
+	}
 
 	sb->s_op = &jbfs_sops;
 	sb->s_time_min = 0;
 	sb->s_time_max = 1ull << JBFS_TIME_SECOND_BITS;
-	// TODO: Support i_cont
-	sb->s_maxbytes =
-	    12 * (sbi->s_group_data_blocks << sbi->s_log_block_size);
+	sb->s_maxbytes = MAX_LFS_FILESIZE;
 
 	root_inode = jbfs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
@@ -173,10 +337,14 @@ static int jbfs_fill_super(struct super_block *sb, void *data, int silent)
 	ret = -ENOMEM;
 	sb->s_root = d_make_root(root_inode);
 	if (sb->s_root) {
+		if (!sb_rdonly(sb))
+			jbfs_start_lazyinit(sb);
 		return 0;
 	}
 
  failed_mount:
+	jbfs_destroy_extent_cache(sb);
+	jbfs_destroy_group_info(sb);
 	brelse(bh);
  failed_sbi:
 	sb->s_fs_info = NULL;
@@ -202,6 +370,7 @@ static struct file_system_type jbfs_fs_type = {
 static void init_once(void *ptr)
 {
 	struct jbfs_inode_info *ji = (struct jbfs_inode_info *)ptr;
+	mutex_init(&ji->i_extent_lock);
 	inode_init_once(&ji->vfs_inode);
 }
 
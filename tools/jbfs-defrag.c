@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2020, 2021 Julian Blaauboer
+
+/*
+ * Defragment files on a mounted jbfs filesystem. All regular files under the
+ * given paths are ranked by their number of extents, and the most fragmented
+ * ones are defragmented first.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "../jbfs_ioctl.h"
+
+struct file_entry {
+	char *path;
+	uint64_t extents;
+};
+
+static struct file_entry *files;
+static size_t num_files, max_files;
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	uint64_t extents;
+	int fd;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "jbfs-defrag: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	if (ioctl(fd, JBFS_IOC_EXTENT_COUNT, &extents) < 0) {
+		if (errno != ENOTTY)
+			fprintf(stderr, "jbfs-defrag: %s: %s\n", path,
+				strerror(errno));
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	if (num_files == max_files) {
+		max_files = max_files ? max_files * 2 : 64;
+		files = realloc(files, max_files * sizeof(*files));
+		if (!files) {
+			perror("jbfs-defrag");
+			exit(1);
+		}
+	}
+
+	files[num_files].path = strdup(path);
+	files[num_files].extents = extents;
+	num_files += 1;
+	return 0;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+	const struct file_entry *fa = a, *fb = b;
+
+	if (fa->extents != fb->extents)
+		return fa->extents < fb->extents ? 1 : -1;
+	return strcmp(fa->path, fb->path);
+}
+
+static int defrag_file(struct file_entry *file)
+{
+	struct jbfs_defrag_range range = { 0 };
+	uint64_t extents = file->extents;
+	int fd, ret;
+
+	fd = open(file->path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "jbfs-defrag: %s: %s\n", file->path,
+			strerror(errno));
+		return -1;
+	}
+
+	ret = ioctl(fd, JBFS_IOC_DEFRAG, &range);
+	if (ret < 0)
+		fprintf(stderr, "jbfs-defrag: %s: %s\n", file->path,
+			strerror(errno));
+	ioctl(fd, JBFS_IOC_EXTENT_COUNT, &extents);
+	close(fd);
+
+	printf("%8llu -> %-8llu %s (%llu blocks moved)\n",
+	       (unsigned long long)file->extents,
+	       (unsigned long long)extents, file->path,
+	       (unsigned long long)range.moved);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: jbfs-defrag [-n] [-m min_extents] [-c count] path...\n"
+		"  -n  only list files by number of extents\n"
+		"  -m  skip files with fewer extents (default 2)\n"
+		"  -c  defragment at most this many files\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t min_extents = 2;
+	size_t count = SIZE_MAX;
+	int dry_run = 0;
+	int status = 0;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "nm:c:")) != -1) {
+		switch (opt) {
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'm':
+			min_extents = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc)
+		usage();
+
+	for (; optind < argc; ++optind) {
+		if (nftw(argv[optind], add_file, 64, FTW_PHYS | FTW_MOUNT)) {
+			perror(argv[optind]);
+			status = 1;
+		}
+	}
+
+	qsort(files, num_files, sizeof(*files), compare_files);
+
+	for (i = 0; i < num_files && i < count; ++i) {
+		if (files[i].extents < min_extents)
+			break;
+
+		if (dry_run)
+			printf("%8llu %s\n", (unsigned long long)files[i].extents,
+			       files[i].path);
+		else if (defrag_file(&files[i]))
+			status = 1;
+	}
+
+	return status;
+}